@@ -0,0 +1,229 @@
+"""Python interface of the xsstokes_disc model.
+
+The model is evaluated by the standalone library built from xsstokes_disc.c,
+
+    gcc -O2 -fPIC -shared -DSTOKESDISC_LIBRARY xsstokes_disc.c \\
+        -I$HEADAS/include -L$HEADAS/lib -lcfitsio -lm -lpthread \\
+        -o libstokesdisc.so
+
+The energy grid, the parameters and the output are C-contiguous float64 NumPy
+arrays passed to the library without copying (arrays of other types or
+layouts are converted first), the interpreter lock is released during the
+evaluation, so models evaluated in several threads run concurrently.
+
+    import numpy as np
+    import stokesdisc
+
+    stokesdisc.xset("XSDIR", "/path/to/xsstokes_disc-master")
+    stokesdisc.xset("STOKESDISC_PRECISION", "double")
+    model = stokesdisc.StokesDisc()
+    ear = np.geomspace(1., 100., 301)
+    #              Size PhoIndex cos_incl pol_deg chi pos_ang zshift Stokes
+    param = np.array([0.3, 2.0, 0.775, 0.1, 0., 30., 0., 5.])
+    pd = model(ear, param)                  # photar[300]
+    walkers = np.tile(param, (64, 1))
+    walkers[:, 5] = np.linspace(-90., 90., 64)
+    pd = model(ear, walkers)                # photar[64, 300]
+    pd, dpd = model.deriv(ear, param)       # and d/d(pol_deg, chi, pos_ang)
+    slices = model.grids([ear, ear[100:]], param)  # one parameter set on
+                                            # several energy grids
+
+The library is looked up in the argument of StokesDisc() or load(), in the
+STOKESDISC_LIBRARY environment variable, next to this file and in its parent
+directory, and by the name "stokesdisc" of the system library search.
+"""
+
+import ctypes
+import ctypes.util
+import os
+import threading
+
+import numpy as np
+
+NPARAM = 8
+NDERIV = 3
+XSET_VALUE = 256    # longest xset value of the library
+
+_lib = None
+_lib_lock = threading.Lock()
+_double_p = ctypes.POINTER(ctypes.c_double)
+
+
+def load(library=None):
+    """Loads the model library (once) and returns it."""
+    global _lib
+    with _lib_lock:
+        if _lib is not None:
+            return _lib
+        here = os.path.dirname(os.path.abspath(__file__))
+        for path in (library, os.environ.get("STOKESDISC_LIBRARY"),
+                     os.path.join(here, "libstokesdisc.so"),
+                     os.path.join(os.path.dirname(here), "libstokesdisc.so")):
+            if path and os.path.exists(path):
+                break
+        else:
+            path = ctypes.util.find_library("stokesdisc")
+        if path is None:
+            raise OSError("stokesdisc: libstokesdisc.so not found, build it "
+                          "with -DSTOKESDISC_LIBRARY")
+        lib = ctypes.CDLL(path)
+        lib.stokesnidisc_context_new.restype = ctypes.c_void_p
+        lib.stokesnidisc_context_new.argtypes = []
+        lib.stokesnidisc_context_free.restype = None
+        lib.stokesnidisc_context_free.argtypes = [ctypes.c_void_p]
+        lib.stokesnidisc_context_dump.restype = ctypes.c_int
+        lib.stokesnidisc_context_dump.argtypes = [ctypes.c_void_p,
+                                                  ctypes.c_char_p]
+        lib.stokesnidisc_batch_ctx.restype = ctypes.c_int
+        lib.stokesnidisc_batch_ctx.argtypes = [
+            ctypes.c_void_p, _double_p, ctypes.c_int, _double_p, ctypes.c_int,
+            ctypes.c_int, _double_p, _double_p, ctypes.c_char_p]
+        lib.stokesnidisc_deriv_ctx.restype = ctypes.c_int
+        lib.stokesnidisc_deriv_ctx.argtypes = [
+            ctypes.c_void_p, _double_p, ctypes.c_int, _double_p, ctypes.c_int,
+            _double_p, _double_p, ctypes.c_char_p]
+        lib.stokesnidisc_grids_ctx.restype = ctypes.c_int
+        lib.stokesnidisc_grids_ctx.argtypes = [
+            ctypes.c_void_p, ctypes.c_int, ctypes.POINTER(_double_p),
+            ctypes.POINTER(ctypes.c_int), _double_p, ctypes.c_int,
+            ctypes.POINTER(_double_p), ctypes.c_char_p]
+        lib.stokesnidisc_xset.restype = ctypes.c_int
+        lib.stokesnidisc_xset.argtypes = [ctypes.c_char_p, ctypes.c_char_p]
+        lib.stokesnidisc_xget.restype = ctypes.c_int
+        lib.stokesnidisc_xget.argtypes = [ctypes.c_char_p, ctypes.c_char_p,
+                                          ctypes.c_int]
+        _lib = lib
+        return lib
+
+
+def xset(name, value):
+    """Sets an xset value of the model (XSDIR, STOKESDISC_...)."""
+    if load().stokesnidisc_xset(str(name).encode(), str(value).encode()):
+        raise ValueError("stokesdisc: cannot set " + str(name))
+
+
+def xget(name):
+    """Returns an xset value of the model, e.g. inc_degrees."""
+    value = ctypes.create_string_buffer(XSET_VALUE)
+    load().stokesnidisc_xget(str(name).encode(), value, XSET_VALUE)
+    return value.value.decode()
+
+
+def _input(a, name, minsize=1):
+    # the same array if it is already C-contiguous float64, the energy grids
+    # need at least two edges
+    a = np.ascontiguousarray(a, dtype=np.float64)
+    if a.size < minsize:
+        raise ValueError("stokesdisc: " + name + " must have at least " +
+                         str(minsize) + " values")
+    return a
+
+
+def _output(out, shape, name):
+    if out is None:
+        return np.empty(shape, dtype=np.float64)
+    if (not isinstance(out, np.ndarray) or out.dtype != np.float64 or
+            not out.flags.c_contiguous or not out.flags.writeable or
+            out.shape != shape):
+        raise ValueError("stokesdisc: " + name + " must be a writeable "
+                         "C-contiguous float64 array of the shape " +
+                         str(shape))
+    return out
+
+
+def _ptr(a):
+    return a.ctypes.data_as(_double_p)
+
+
+class StokesDisc:
+    """Evaluation context of the model.
+
+    Every instance keeps its own cache of the interpolated tables and work
+    arrays, i.e. instances may be evaluated concurrently in several threads,
+    one instance must not be evaluated by several threads at once. All the
+    instances share one copy of the tables.
+    """
+
+    def __init__(self, library=None, dump=None):
+        self._lib = load(library)
+        self._ctx = self._lib.stokesnidisc_context_new()
+        if not self._ctx:
+            raise MemoryError("stokesdisc: not enough memory for the context")
+        if dump is not None:
+            self._lib.stokesnidisc_context_dump(self._ctx, str(dump).encode())
+
+    def __call__(self, ear, param, out=None):
+        """Returns the output photar[ne] of the parameters param[8], or
+        photar[n, ne] of the parameter sets param[n, 8], on the energy grid
+        ear[ne+1]; out is an optional array for the output."""
+        ear = _input(ear, "ear", 2)
+        param = _input(param, "param")
+        if param.shape[-1] != NPARAM or param.ndim > 2:
+            raise ValueError("stokesdisc: param must be of the shape (8,) or "
+                             "(n, 8)")
+        ne = ear.size - 1
+        nvec = param.size // NPARAM
+        out = _output(out, param.shape[:-1] + (ne,), "out")
+        if self._lib.stokesnidisc_batch_ctx(self._ctx, _ptr(ear), ne,
+                                            _ptr(param), nvec, 1, _ptr(out),
+                                            None, b""):
+            raise RuntimeError("stokesdisc: the evaluation failed")
+        return out
+
+    def deriv(self, ear, param, out=None, dout=None):
+        """Returns the output photar[ne] of the parameters param[8] and its
+        derivatives dphotar[3, ne] with respect to pol_deg, chi and pos_ang
+        (per degree)."""
+        ear = _input(ear, "ear", 2)
+        param = _input(param, "param")
+        if param.shape != (NPARAM,):
+            raise ValueError("stokesdisc: param must be of the shape (8,)")
+        ne = ear.size - 1
+        out = _output(out, (ne,), "out")
+        dout = _output(dout, (NDERIV, ne), "dout")
+        if self._lib.stokesnidisc_deriv_ctx(self._ctx, _ptr(ear), ne,
+                                            _ptr(param), 1, _ptr(out),
+                                            _ptr(dout), b""):
+            raise RuntimeError("stokesdisc: the evaluation failed")
+        return out, dout
+
+    def grids(self, ears, param, outs=None):
+        """Returns the list of the outputs photar[ne_k] of the parameters
+        param[8] on each of the energy grids ears[k][ne_k+1] (e.g. of time
+        resolved spectra), the tables are interpolated in the parameters
+        once and only rebinned onto every grid; outs is an optional list of
+        arrays for the outputs."""
+        ears = [_input(ear, "ear", 2) for ear in ears]
+        param = _input(param, "param")
+        if param.shape != (NPARAM,):
+            raise ValueError("stokesdisc: param must be of the shape (8,)")
+        ngrid = len(ears)
+        if outs is None:
+            outs = [None] * ngrid
+        outs = [_output(out, (ear.size - 1,), "outs")
+                for ear, out in zip(ears, outs)]
+        ne = (ctypes.c_int * ngrid)(*[ear.size - 1 for ear in ears])
+        ear_p = (_double_p * ngrid)(*[_ptr(ear) for ear in ears])
+        out_p = (_double_p * ngrid)(*[_ptr(out) for out in outs])
+        if self._lib.stokesnidisc_grids_ctx(self._ctx, ngrid, ear_p, ne,
+                                            _ptr(param), 1, out_p, b""):
+            raise RuntimeError("stokesdisc: the evaluation failed")
+        return outs
+
+    def close(self):
+        """Releases the context."""
+        if self._ctx:
+            self._lib.stokesnidisc_context_free(self._ctx)
+            self._ctx = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def __del__(self):
+        try:
+            self.close()
+        except Exception:
+            pass
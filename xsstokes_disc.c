@@ -1,313 +1,4262 @@
-/* stokes - polarized reflection from an axially symmetric surface illuminated 
- *	    isotropically by an (un)polarised power law,
- *        - an example of a polarisation subroutine for XSPEC using disc reflection 
- *	    tables computed with STOKES code (Podgorny et al. 2022), integrated between
- *	    0 <= cos_incl_incident <= M only to represent distant disc reflection
- * 
- *
- * This subroutine computes the emission from a neutral slab that is illuminated 
- * under high inclination angles by a primary power-law
- *
- * par1 ... Size - the upper limit M_i in cos_incl_incident integration,
- *			representing the corona size
- * par2 ... PhoIndex - power-law photon index of the primary flux
- * par3 ... cos_incl - cosine of the observer inclination (1.-pole, 0.-disc)
- * par4 ... pol_deg  - intrinsic polarisation degree of primary radiation
- * par5 ... chi - intrinsic polarisation angle (in degrees, -90 < chi < 90)
- *		       of primary radiation, the orientation is degenarate by 
- *		       180 degrees
- * par6 ... pos_ang - orientation of the system (-90 < pos_ang < 90), 
- *                    the position angle (in degrees) of the system 
- *                    rotation axis with direction up,
- *                    the orientation is degenarate by 180 degrees
- * par7 ... zshift  - overall Doppler shift
- * par8 ... Stokes  - what should be stored in photar() array, i.e. as output
- *                    = -1 - the output is defined according to the XFLT0001 
- *                           keyword of the SPECTRUM extension of the data file,
- *                           where "Stokes:0" means photon number density flux,
- *                           "Stokes:1" means Stokes parameter Q devided by 
- *                           energy and "Stokes:2" means Stokes parameter U 
- *                           devided by energy
- *                    =  0 - array of photon number density flux per bin
- *                          (array of Stokes parameter I devided by energy)
- *                           with the polarisation computations switched off
- *                          (unpolarised primary is assumed)
- *                    =  1 - array of photon number density flux per bin
- *                          (array of Stokes parameter I devided by energy),
- *                           with the polarisation computations switched on
- *                    =  2 - array of Stokes parameter Q devided by energy
- *                    =  3 - array of Stokes parameter U devided by energy
- *                    =  4 - array of Stokes parameter V devided by energy
- *                    =  5 - array of degree of polarization
- *                    =  6 - array of polarization angle psi=0.5*atan(U/Q)
- *                    =  7 - array of "Stokes" angle
- *                           beta=0.5*asin(V/sqrt(Q*Q+U*U+V*V))
- *                    =  8 - array of Stokes parameter Q devided by I
- *                    =  9 - array of Stokes parameter U devided by I
- *                    = 10 - array of Stokes parameter V devided by I
- *
- ******************************************************************************/
-
-#include <math.h>
-#include <string.h>
-#include <stdio.h>
-#include <stdlib.h>
-
-/*******************************************************************************
-*******************************************************************************/
-#ifdef OUTSIDE_XSPEC
-
-#define IFL    1
-#define NPARAM 4
-#define NE     200
-#define E_MIN  1.
-#define E_MAX  100.
-
-int main() {
-
-int stokesnidisc(const double *ear, int ne, const double *param, int ifl,
-               double *photar, double *photer, const char* init);
-
-
-double ear[NE+1], photar[NE], photer[NE], param[NPARAM];
-char   initstr[0] = "";
-int    ie;
-
-param[ 0] = 0.3;        // Size
-param[ 1] = 2.0;        // PhoIndex
-param[ 2] = 0.775;      // cos_incl
-param[ 3] = 0.;         // poldeg
-param[ 4] = 0.;         // chi
-param[ 5] = 0.;         // pos_ang
-param[ 6] = 0.;         // zshift
-param[ 7] = 1.;         // Stokes
-
-for(ie = 0; ie <= NE; ie++) {
-//  ear[ie] = E_MIN + ie * (E_MAX-E_MIN) / NE;
-  ear[ie] = E_MIN * pow(E_MAX / E_MIN, ((double) ie) / NE);
-}
-
-stokesnidisc(ear, NE, param, IFL, photar, photer, initstr);
-return(0);
-}
-
-#endif
-/*******************************************************************************
-*******************************************************************************/
-
-#define REFSPECTRA1 "stokes-neutral-iso-UNPOL-disc.fits\0" // UNPOLARISED
-#define REFSPECTRA2 "stokes-neutral-iso-HRPOL-disc.fits\0" // HORIZONTALLY POLARISED
-#define REFSPECTRA3 "stokes-neutral-iso-45DEG-disc.fits\0" // DIAGONALLY POLARISED
-
-#define PI   3.14159265358979
-#define NPAR 4
-
-extern int    xs_write(char* wrtstr, int idest);
-extern float  DGFILT(int ifl, const char* key);
-extern void   FPMSTR(const char* value1, const char* value2);
-extern char*  FGMSTR(char* dname);
-extern void   tabintxflt(float* ear, int ne, float* param, const int npar, 
-                         const char* filenm, const char **xfltname, 
-                         const float *xfltvalue, const int nxflt,
-                         const char* tabtyp, float* photar, float* photer);
-
-int stokesnidisc(const double *ear, int ne, const double *param, int ifl,
-            double *photar, double *photer, const char* init) {
-
-FILE   *fw;
-static char   xsdir[255]="";
-static char   pname[128]="XSDIR", pinc_degrees[128] = "inc_degrees";
-static char refspectra[3][255];
-//static int    first = 1;
-int status = 0;
-
-// - if set try XSDIR directory, otherwise look in the working directory
-// Initialize refspectra elements and visibility file path
-sprintf(xsdir, "%s", FGMSTR(pname));
-if (strlen(xsdir) == 0) {
-    strcpy(refspectra[0], REFSPECTRA1);
-    strcpy(refspectra[1], REFSPECTRA2);
-    strcpy(refspectra[2], REFSPECTRA3);
-} else {
-    if (xsdir[strlen(xsdir) - 1] == '/') {
-        sprintf(refspectra[0], "%s%s", xsdir, REFSPECTRA1);
-        sprintf(refspectra[1], "%s%s", xsdir, REFSPECTRA2);
-        sprintf(refspectra[2], "%s%s", xsdir, REFSPECTRA3);
-    } else {
-        sprintf(refspectra[0], "%s/%s", xsdir, REFSPECTRA1);
-        sprintf(refspectra[1], "%s/%s", xsdir, REFSPECTRA2);
-        sprintf(refspectra[2], "%s/%s", xsdir, REFSPECTRA3);
-    }
-}
-
-
-int    i, j, ie, stokes;
-double pol_deg, chi, pos_ang;
-const char*   xfltname = "Stokes";
-float  xfltvalue;
-float  Smatrix[9][ne];
-float  fl_param[NPAR]={(float) param[0], (float) param[1], (float) param[2],(float) param[6]};
-const char*  tabtyp="add";
-float  fl_ear[ne+1], fl_photer[ne];
-double far[ne], qar[ne], uar[ne], var[ne], pd[ne], pa[ne], pa2[ne], 
-       qar_final[ne], uar_final[ne];
-double pamin, pamax, pa2min, pa2max, inc_tot;
-
-char inc_degrees[32];
-
-pol_deg = param[3];
-chi = param[4]/180.*PI;
-pos_ang = param[5]/180.*PI;
-stokes = (int) param[7];
-inc_tot = acos((float) param[2]) / PI * 180.0;
-if(stokes == -1){
-  xfltvalue = DGFILT(ifl, xfltname);
-  if (xfltvalue == 0. || xfltvalue == 1. || xfltvalue == 2.){
-    stokes = 1 + (int) xfltvalue;
-  }
-  else {
-    xs_write("stokes: no or wrong information on data type (counts, q, u)", 5);
-    xs_write("stokes: stokes = par8 = 0 (i.e. counts) will be used", 5);
-    stokes=0;
-  }
-}
-
-//Let's read and interpolate the FITS tables that we will need using internal
-//XSPEC routine tabintxflt
-//Note that we do not use errors here
-for(ie = 0; ie <= ne; ie++) fl_ear[ie] = (float) ear[ie];
-if(stokes){//we use polarised tables  
-//  if (first) {
-  // The status parameter must always be initialized.
-  status = 0;
-
-  for (i = 0; i <= 2; i++)
-    for (j = 0; j <= 2; j++){
-      xfltvalue = (float) j;
-      tabintxflt(fl_ear, ne, fl_param, NPAR, refspectra[i], &xfltname, 
-                 &xfltvalue, 1, tabtyp, Smatrix[i*3+j], fl_photer);  
-      }
-
-//  first = 0;
-//  }
-
-  //Let's perform the transformation to initial primary polarisation degree and angle
-  for(ie = 0; ie < ne; ie++) {
-//        UNPOLARISED i = 0,1,2; HORIZONTALLY POLARISED i = 3,4,5, 45DEG POLARISED i = 6,7,8     
-    for(j=0; j<=2; j++) Smatrix[j+3][ie] -= Smatrix[j][ie];
-    for(j=0; j<=2; j++) Smatrix[j+6][ie] -= Smatrix[j][ie];
-    far[ie] = Smatrix[0][ie] +
-                        pol_deg * ( -Smatrix[3][ie] * cos(2.*(chi)) +
-                                    Smatrix[6][ie] * sin(2.*(chi)) );
-    qar[ie] = Smatrix[1][ie] +
-                        pol_deg * ( -Smatrix[4][ie] * cos(2.*(chi))+
-                                    Smatrix[7][ie] * sin(2.*(chi)) );
-    uar[ie] = Smatrix[2][ie] +
-                        pol_deg * ( -Smatrix[5][ie] * cos(2.*(chi))+
-                                    Smatrix[8][ie] * sin(2.*(chi)) );
-    var[ie] = 0.;   
-  }
-}else{//we just use unpolarised counts
-//  if (first) {
-// The status parameter must always be initialized.
-  status = 0;
-
-  xfltvalue = 0.;
-  tabintxflt(fl_ear, ne, fl_param, NPAR, refspectra[0], &xfltname, &xfltvalue, 
-             1, tabtyp, Smatrix[0], fl_photer);  
-
-//  first = 0;
-//  }
-
-  for(ie = 0; ie < ne; ie++){
-    far[ie] = Smatrix[0][ie];
-  }
-}
-
-sprintf(inc_degrees, "%12.6f", inc_tot);
-FPMSTR(pinc_degrees, inc_degrees);
-
-/******************************************************************************/
-#ifdef OUTSIDE_XSPEC
-// let's write the input parameters to a file
-fw = fopen("parameters.txt", "w");
-fprintf(fw, "Size        %12.6f\n", param[0]);
-fprintf(fw, "PhoIndex        %12.6f\n", param[1]);
-fprintf(fw, "cos_incl     %12.6f\n", param[2]);
-fprintf(fw, "poldeg        %12.6f\n", param[3]);
-fprintf(fw, "chi         %12.6f\n", param[4]);
-fprintf(fw, "pos_ang        %12.6f\n", param[5]);
-fprintf(fw, "zshift      %12.6f\n", param[6]);
-fprintf(fw, "Stokes      %12d\n", (int) param[7]);
-fprintf(fw, "inc_degrees      %12.6f\n", x0);
-fclose(fw);
-#endif
-/******************************************************************************/
-
-// interface with XSPEC
-if (!stokes) for (ie = 0; ie < ne; ie++) photar[ie] = far[ie];
-else {
-// let's change the orientation of the system 
-  if(pos_ang != 0.)
-   for( ie=0; ie<ne; ie++ ){
-      qar_final[ie] = qar[ie] * cos(2*pos_ang) - uar[ie] * sin(2*pos_ang);
-      uar_final[ie] = uar[ie] * cos(2*pos_ang) + qar[ie] * sin(2*pos_ang);
-    }
-   else
-    for( ie=0; ie<ne; ie++ ){
-      qar_final[ie] = qar[ie];
-      uar_final[ie] = uar[ie];
-    }
-  pamin = 1e30;
-  pamax = -1e30;
-  pa2min = 1e30;
-  pa2max = -1e30;
-  for (ie = ne - 1; ie >= 0; ie--) {
-    pd[ie] = sqrt(qar_final[ie] * qar_final[ie] + uar_final[ie] * uar_final[ie] 
-                  + var[ie] * var[ie]) / (far[ie] + 1e-99);
-    pa[ie] = 0.5 * atan2(uar_final[ie], qar_final[ie]) / PI * 180.;
-    if (ie < (ne - 1)) {
-      while ((pa[ie] - pa[ie + 1]) > 90.) pa[ie] -= 180.;
-      while ((pa[ie + 1] - pa[ie]) > 90.) pa[ie] += 180.;
-    }
-    if (pa[ie] < pamin) pamin = pa[ie];
-    if (pa[ie] > pamax) pamax = pa[ie];
-    pa2[ie] = 0.5 * asin(var[ie] / sqrt(qar_final[ie] * qar_final[ie] 
-                         + uar_final[ie] * uar_final[ie] + var[ie] * var[ie] 
-                         + 1e-99)) / PI * 180.;
-    if (ie < (ne - 1)) {
-      while ((pa2[ie] - pa2[ie + 1]) > 90.) pa2[ie] -= 180.;
-      while ((pa2[ie + 1] - pa2[ie]) > 90.) pa2[ie] += 180.;
-    }
-    if (pa2[ie] < pa2min) pa2min = pa2[ie];
-    if (pa2[ie] > pa2max) pa2max = pa2[ie];
-  }
-  fw = fopen("stokes.dat", "w");
-  for (ie = 0; ie < ne; ie++) {
-    if ((pamax + pamin) > 180.) pa[ie] -= 180.;
-    if ((pamax + pamin) < -180.) pa[ie] += 180.;
-    if ((pa2max + pa2min) > 180.) pa2[ie] -= 180.;
-    if ((pa2max + pa2min) < -180.) pa2[ie] += 180.;
-    fprintf(fw,
-      "%E\t%E\t%E\t%E\t%E\t%E\t%E\t%E\n", 
-      0.5 * (ear[ie] + ear[ie+1]), far[ie] / (ear[ie+1] - ear[ie]), 
-      qar_final[ie] / (ear[ie+1] - ear[ie]), 
-      uar_final[ie] / (ear[ie+1] - ear[ie]), 
-      var[ie] / (ear[ie+1] - ear[ie]), pd[ie], pa[ie], pa2[ie]);
-//interface with XSPEC..........................................................
-    if (stokes ==  1) photar[ie] = far[ie];
-    if (stokes ==  2) photar[ie] = qar_final[ie];
-    if (stokes ==  3) photar[ie] = uar_final[ie];
-    if (stokes ==  4) photar[ie] = var[ie];
-    if (stokes ==  5) photar[ie] = pd[ie] * (ear[ie + 1] - ear[ie]);
-    if (stokes ==  6) photar[ie] = pa[ie] * (ear[ie + 1] - ear[ie]);
-    if (stokes ==  7) photar[ie] = pa2[ie] * (ear[ie + 1] - ear[ie]);
-    if (stokes ==  8) photar[ie] = qar_final[ie] / (far[ie]+1e-99) * (ear[ie + 1] - ear[ie]);
-    if (stokes ==  9) photar[ie] = uar_final[ie] / (far[ie]+1e-99) * (ear[ie + 1] - ear[ie]);
-    if (stokes == 10) photar[ie] = var[ie] / (far[ie]+1e-99) * (ear[ie + 1] - ear[ie]);
-  }
-  fclose(fw);
-}
-
-return 0;
-}
+/* stokes - polarized reflection from an axially symmetric surface illuminated 
+ *	    isotropically by an (un)polarised power law,
+ *        - an example of a polarisation subroutine for XSPEC using disc reflection 
+ *	    tables computed with STOKES code (Podgorny et al. 2022), integrated between
+ *	    0 <= cos_incl_incident <= M only to represent distant disc reflection
+ * 
+ *
+ * This subroutine computes the emission from a neutral slab that is illuminated 
+ * under high inclination angles by a primary power-law
+ *
+ * par1 ... Size - the upper limit M_i in cos_incl_incident integration,
+ *			representing the corona size
+ * par2 ... PhoIndex - power-law photon index of the primary flux
+ * par3 ... cos_incl - cosine of the observer inclination (1.-pole, 0.-disc)
+ * par4 ... pol_deg  - intrinsic polarisation degree of primary radiation
+ * par5 ... chi - intrinsic polarisation angle (in degrees, -90 < chi < 90)
+ *		       of primary radiation, the orientation is degenarate by 
+ *		       180 degrees
+ * par6 ... pos_ang - orientation of the system (-90 < pos_ang < 90), 
+ *                    the position angle (in degrees) of the system 
+ *                    rotation axis with direction up,
+ *                    the orientation is degenarate by 180 degrees
+ * par7 ... zshift  - overall Doppler shift
+ * par8 ... Stokes  - what should be stored in photar() array, i.e. as output
+ *                    = -1 - the output is defined according to the XFLT0001 
+ *                           keyword of the SPECTRUM extension of the data file,
+ *                           where "Stokes:0" means photon number density flux,
+ *                           "Stokes:1" means Stokes parameter Q devided by 
+ *                           energy and "Stokes:2" means Stokes parameter U 
+ *                           devided by energy
+ *                    =  0 - array of photon number density flux per bin
+ *                          (array of Stokes parameter I devided by energy)
+ *                           with the polarisation computations switched off
+ *                          (unpolarised primary is assumed)
+ *                    =  1 - array of photon number density flux per bin
+ *                          (array of Stokes parameter I devided by energy),
+ *                           with the polarisation computations switched on
+ *                    =  2 - array of Stokes parameter Q devided by energy
+ *                    =  3 - array of Stokes parameter U devided by energy
+ *                    =  4 - array of Stokes parameter V devided by energy
+ *                    =  5 - array of degree of polarization
+ *                    =  6 - array of polarization angle psi=0.5*atan(U/Q)
+ *                    =  7 - array of "Stokes" angle
+ *                           beta=0.5*asin(V/sqrt(Q*Q+U*U+V*V))
+ *                    =  8 - array of Stokes parameter Q devided by I
+ *                    =  9 - array of Stokes parameter U devided by I
+ *                    = 10 - array of Stokes parameter V devided by I
+ *
+ ******************************************************************************/
+
+#include <math.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <pthread.h>
+#include "fitsio.h"
+#if defined(STOKESDISC_OFFLOAD) && !defined(_OPENMP)
+#error "STOKESDISC_OFFLOAD requires OpenMP (e.g. -fopenmp)"
+#endif
+#if defined(STOKESDISC_SERVER) && \
+    (defined(OUTSIDE_XSPEC) || defined(STOKESDISC_LIBRARY))
+#error "STOKESDISC_SERVER cannot be combined with OUTSIDE_XSPEC or the library"
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define REFSPECTRA1 "stokes-neutral-iso-UNPOL-disc.fits\0" // UNPOLARISED
+#define REFSPECTRA2 "stokes-neutral-iso-HRPOL-disc.fits\0" // HORIZONTALLY POLARISED
+#define REFSPECTRA3 "stokes-neutral-iso-45DEG-disc.fits\0" // DIAGONALLY POLARISED
+#define REFBINARY   "stokes-neutral-iso-disc.bin\0"        // ALL THREE, PREPROCESSED
+#define REFBINARY_DIFF "stokes-neutral-iso-disc-diff.bin\0" // COMPACT STORAGE
+#define REFBINARY_HALF "stokes-neutral-iso-disc-half.bin\0" // HALF PRECISION
+
+#define PI    3.14159265358979
+#define NPAR  4
+#define NCOMP 9
+
+extern int    xs_write(char* wrtstr, int idest);
+extern float  DGFILT(int ifl, const char* key);
+extern void   FPMSTR(const char* value1, const char* value2);
+extern char*  FGMSTR(char* dname);
+extern void   tabintxflt(float* ear, int ne, float* param, const int npar, 
+                         const char* filenm, const char **xfltname, 
+                         const float *xfltvalue, const int nxflt,
+                         const char* tabtyp, float* photar, float* photer);
+
+/*******************************************************************************
+* Settings
+*
+* FGMSTR returns the xset values in a static buffer of XSPEC, the contexts 
+* evaluated at once in several threads must therefore not read them at the 
+* same time. The settings (XSDIR, STOKESDISC_...) are copied under xspec_lock
+* at the start of every call into the copy of the calling thread, which is 
+* then read during the call. All the other XSPEC routines (DGFILT, FPMSTR, 
+* tabintxflt and xs_write by stokes_write()) are called under the same lock.
+*******************************************************************************/
+
+#define SETTING_LEN   256   // longer values are cut (XSDIR is then too long)
+#define SET_XSDIR     0
+#define SET_THREADS   1
+#define SET_BINARY    2
+#define SET_CACHE_MB  3
+#define SET_DUMP      4
+#define SET_STATS     5
+#define SET_TABLES    6
+#define SET_PRECISION 7
+#define SET_STORAGE   8
+#define SET_ADAPTIVE  9
+#define SET_OFFLOAD   10
+#define NSETTINGS     11
+
+static char setting_names[NSETTINGS][128] = {"XSDIR", "STOKESDISC_THREADS", 
+  "STOKESDISC_BINARY", "STOKESDISC_CACHE_MB", "STOKESDISC_DUMP", 
+  "STOKESDISC_STATS", "STOKESDISC_TABLES", "STOKESDISC_PRECISION", 
+  "STOKESDISC_STORAGE", "STOKESDISC_ADAPTIVE", "STOKESDISC_OFFLOAD"};
+static pthread_mutex_t   xspec_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local char settings[NSETTINGS][SETTING_LEN];
+
+// copies the settings for this call of the calling thread
+static void settings_read(void) {
+const char *value;
+int        k;
+
+pthread_mutex_lock(&xspec_lock);
+for (k = 0; k < NSETTINGS; k++) {
+  value = FGMSTR(setting_names[k]);
+  snprintf(settings[k], SETTING_LEN, "%s", value != NULL ? value : "");
+}
+pthread_mutex_unlock(&xspec_lock);
+}
+
+// writes the message by xs_write (to the destination chatter level dest)
+static void stokes_write(const char *message, int dest) {
+pthread_mutex_lock(&xspec_lock);
+xs_write((char *) message, dest);
+pthread_mutex_unlock(&xspec_lock);
+}
+
+/*******************************************************************************
+* Paths to the tables
+*
+* The tables are searched for in the XSDIR directory if it is set by 
+* "xset XSDIR <directory>", otherwise in the working directory. The paths are 
+* resolved only when XSDIR changes and it is checked at that time that all
+* three tables exist. If a path does not fit into PATH_LEN characters or if a
+* table is missing, an error is reported once and the model returns zeros 
+* until XSDIR is set again.
+*******************************************************************************/
+
+#define PATH_LEN 255
+#define NTABLES  3
+#define NSTORAGE 3
+
+typedef struct {
+  int  state;                        // -1 - unresolved, 0 - error, 1 - valid
+  long generation;                   // incremented at every change of paths
+  char xsdir[PATH_LEN];              // XSDIR the paths were resolved for
+  int  xsdir_long;                   // 1 if XSDIR did not fit into xsdir
+  char refspectra[NTABLES][PATH_LEN];// UNPOL, HRPOL and 45DEG tables
+  char binary[NSTORAGE][PATH_LEN];   // preprocessed tables of each storage
+                                     // ("" - none)
+} table_paths;
+
+static const char *refspectra_names[NTABLES] = {REFSPECTRA1, REFSPECTRA2, 
+                                                REFSPECTRA3};
+static const char *binary_names[NSTORAGE] = {REFBINARY, REFBINARY_DIFF, 
+                                             REFBINARY_HALF};
+
+// resolves the paths to the tables if XSDIR has changed, 
+// returns 0 if the paths are valid, 1 otherwise
+static int table_paths_resolve(table_paths *t) {
+const char  *xsdir = settings[SET_XSDIR], *sep;
+char        errstr[PATH_LEN + 64];
+size_t      len;
+FILE        *fr;
+int         i;
+
+len = strlen(xsdir);
+if (t->state >= 0 && t->xsdir_long == (len >= PATH_LEN) && 
+    !strncmp(t->xsdir, xsdir, PATH_LEN - 1)) return t->state != 1;
+t->generation++;
+t->xsdir_long = (len >= PATH_LEN);
+snprintf(t->xsdir, PATH_LEN, "%s", xsdir);
+t->state = 1;
+sep = (len == 0 || xsdir[len - 1] == '/') ? "" : "/";
+for (i = 0; i < NTABLES; i++) {
+  if (t->xsdir_long || snprintf(t->refspectra[i], PATH_LEN, "%s%s%s", xsdir, 
+                                sep, refspectra_names[i]) >= PATH_LEN) {
+    stokes_write("stokes: the path to the tables in XSDIR is too long", 5);
+    t->refspectra[i][0] = '\0';
+    t->state = 0;
+    break;
+  }
+  if ((fr = fopen(t->refspectra[i], "r")) == NULL) {
+    snprintf(errstr, sizeof(errstr), "stokes: cannot find the table %s", 
+             t->refspectra[i]);
+    stokes_write(errstr, 5);
+    t->state = 0;
+  }
+  else fclose(fr);
+}
+if (t->state != 1) 
+  stokes_write("stokes: set the directory with the tables by xset XSDIR", 5);
+else 
+  for (i = 0; i < NSTORAGE; i++)
+    if (snprintf(t->binary[i], PATH_LEN, "%s%s%s", xsdir, sep, 
+                 binary_names[i]) >= PATH_LEN) t->binary[i][0] = '\0';
+return t->state != 1;
+}
+
+/*******************************************************************************
+* Parallel evaluation
+*
+* If the model is compiled with OpenMP (e.g. with -fopenmp added to the 
+* compiler flags of the local model package), "xset STOKESDISC_THREADS <n>" 
+* splits the native table interpolation and the output kernels of one 
+* evaluation over n threads (0 - all available threads), each thread working 
+* on its own energy range of all the table components. The energy grid is 
+* split only into ranges of at least PAR_MIN_BINS bins. The XSPEC routine 
+* tabintxflt is always called from one thread. By default, and without 
+* OpenMP, one thread is used.
+*******************************************************************************/
+
+#define PAR_MIN_BINS 256
+
+#ifdef _OPENMP
+#define PARALLEL_FOR _Pragma("omp parallel for num_threads(par_threads) \
+schedule(static) if(par_threads > 1)")
+#else
+#define PARALLEL_FOR
+#endif
+
+static _Thread_local int par_threads = 1;
+
+// sets the number of threads used for the evaluation on ne energy bins
+static void par_threads_set(int ne) {
+int         n = 1;
+#ifdef _OPENMP
+if (strlen(settings[SET_THREADS])) n = atoi(settings[SET_THREADS]);
+if (n <= 0) n = omp_get_max_threads();
+#endif
+if (n > ne / PAR_MIN_BINS) n = ne / PAR_MIN_BINS;
+par_threads = n > 1 ? n : 1;
+}
+
+// first bin of the part c of n equal parts of ne bins
+static int par_first(int ne, int c, int n) {
+return (int) ((long) ne * c / n);
+}
+
+/*******************************************************************************
+* Native table engine
+*
+* The three tables share the same parameter grid and energy bins, therefore 
+* they are read once into one contiguous array with the layout 
+* data[grid point][energy bin][stored component] (component = table * 3 + 
+* Stokes XFLT, see Section Compact storage for the stored components). At 
+* every evaluation the bracketing grid points and the interpolation weights 
+* are computed once for all nine components and the blended table spectrum is 
+* rebinned onto the model energy grid in one pass. The interpolation follows 
+* the XSPEC table models, i.e. it is linear (METHOD 0) or logarithmic 
+* (METHOD 1) in each interpolated parameter, the table spectra are assumed to 
+* be constant within the table energy bins and if the table contains the 
+* REDSHIFT keyword, the last parameter is the redshift applied to the energies.
+*
+* The engine is used by default, "xset STOKESDISC_TABLES xspec" switches back 
+* to the XSPEC routine tabintxflt, which is also used if the native reading 
+* of the tables fails. The tables are read-only once loaded and they are 
+* shared by all evaluation contexts of the process, up to TABLE_SETS table 
+* directories are kept loaded.
+*******************************************************************************/
+
+#define ENGINE_NATIVE 0
+#define ENGINE_XSPEC  1
+#define ENGINE_DOUBLE 2
+#define TABLE_SETS    4
+#define STORAGE_FULL  0
+#define STORAGE_DIFF  1
+#define STORAGE_HALF  2
+
+typedef struct {
+  char   source[PATH_LEN];   // UNPOL table path the tables were read from
+  int    state;              // -1 - not read, 0 - error, 1 - ready
+  int    nintparm;           // number of interpolated parameters
+  int    redshift;           // 1 if the last parameter is redshift
+  int    nvals[NPAR];        // number of grid values of each parameter
+  int    method[NPAR];       // 0 - linear, 1 - logarithmic interpolation
+  double *vals[NPAR];        // grid values of each parameter
+  long   stride[NPAR];       // grid index stride of each parameter
+  long   ngrid;              // number of grid points
+  int    nebin;              // number of table energy bins
+  double *energy;            // table energy bin edges, energy[nebin+1]
+  int    storage;            // STORAGE_FULL, STORAGE_DIFF or STORAGE_HALF
+  int    ncomp;              // number of stored components
+  int    index[NCOMP];       // stored index of each component (-1 - zero)
+  float  *data;              // data[(grid * nebin + bin) * ncomp + index]
+  uint16_t *half;            // the same in half precision (STORAGE_HALF)
+  float  *scale;             // scale[grid * ncomp + index] of the half data
+  double half_error[2];      // largest error of the half data relative to 
+                             // the spectrum maximum and to the value
+  void   *dev_data, *dev_energy, *dev_scale, *dev_half; // copies of data (or
+                             // half), energy, scale and of the values of the 
+                             // half precision numbers on the offload device
+  void   *map;               // mapped preprocessed tables (NULL - not mapped)
+  size_t map_size;           // size of the mapping
+} stokes_tables;
+
+static stokes_tables   table_sets[TABLE_SETS];
+static pthread_mutex_t tables_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef STOKESDISC_OFFLOAD
+// releases the copy of the tables on the device
+static void tables_device_free(stokes_tables *t) {
+int dev = omp_get_default_device();
+
+if (t->dev_data != NULL) omp_target_free(t->dev_data, dev);
+if (t->dev_energy != NULL) omp_target_free(t->dev_energy, dev);
+if (t->dev_scale != NULL) omp_target_free(t->dev_scale, dev);
+if (t->dev_half != NULL) omp_target_free(t->dev_half, dev);
+t->dev_data = t->dev_energy = t->dev_scale = t->dev_half = NULL;
+}
+#endif
+
+// releases the memory of the tables
+static void tables_free(stokes_tables *t) {
+int p;
+
+if (t->map != NULL) munmap(t->map, t->map_size);
+else {
+  for (p = 0; p < NPAR; p++) free(t->vals[p]);
+  free(t->energy);
+  free(t->data);
+  free(t->half);
+  free(t->scale);
+}
+for (p = 0; p < NPAR; p++) t->vals[p] = NULL;
+t->map = NULL;
+t->map_size = 0;
+t->energy = NULL;
+t->data = NULL;
+t->half = NULL;
+t->scale = NULL;
+t->ncomp = 0;
+#ifdef STOKESDISC_OFFLOAD
+tables_device_free(t);
+#endif
+t->ngrid = 0;
+t->nebin = 0;
+}
+
+// reads the parameter grid and the energy bins from the first table
+static int tables_read_grid(stokes_tables *t, fitsfile *fptr, int *status) {
+int    p, col, anynul;
+long   nrows, ngrid;
+
+t->redshift = 0;
+fits_movabs_hdu(fptr, 1, NULL, status);
+fits_read_key(fptr, TLOGICAL, "REDSHIFT", &t->redshift, NULL, status);
+if (*status == KEY_NO_EXIST) *status = 0;
+fits_movnam_hdu(fptr, BINARY_TBL, "PARAMETERS", 0, status);
+fits_read_key(fptr, TINT, "NINTPARM", &t->nintparm, NULL, status);
+if (*status) return *status;
+if (t->nintparm < 1 || t->nintparm + t->redshift > NPAR) {
+  stokes_write("stokes: unexpected number of parameters in the tables", 5);
+  return *status = -1;
+}
+ngrid = 1;
+for (p = t->nintparm - 1; p >= 0; p--) {
+  fits_get_colnum(fptr, CASEINSEN, "NUMBVALS", &col, status);
+  fits_read_col(fptr, TINT, col, p + 1, 1, 1, NULL, &t->nvals[p], &anynul, 
+                status);
+  fits_get_colnum(fptr, CASEINSEN, "METHOD", &col, status);
+  fits_read_col(fptr, TINT, col, p + 1, 1, 1, NULL, &t->method[p], &anynul, 
+                status);
+  if (*status) return *status;
+  if (t->nvals[p] < 1) return *status = -1;
+  if ((t->vals[p] = (double *) malloc(t->nvals[p] * sizeof(double))) == NULL)
+    return *status = -1;
+  fits_get_colnum(fptr, CASEINSEN, "VALUE", &col, status);
+  fits_read_col(fptr, TDOUBLE, col, p + 1, 1, t->nvals[p], NULL, t->vals[p],
+                &anynul, status);
+  // the last parameter changes the fastest in data[]
+  t->stride[p] = ngrid;
+  ngrid *= t->nvals[p];
+}
+t->ngrid = ngrid;
+fits_movnam_hdu(fptr, BINARY_TBL, "ENERGIES", 0, status);
+fits_get_num_rows(fptr, &nrows, status);
+if (*status) return *status;
+t->nebin = (int) nrows;
+t->energy = (double *) malloc((nrows + 1) * sizeof(double));
+t->data = (float *) calloc(ngrid * nrows * NCOMP, sizeof(float));
+if (t->energy == NULL || t->data == NULL) {
+  stokes_write("stokes: not enough memory for the tables", 5);
+  return *status = -1;
+}
+fits_get_colnum(fptr, CASEINSEN, "ENERG_LO", &col, status);
+fits_read_col(fptr, TDOUBLE, col, 1, 1, nrows, NULL, t->energy, &anynul, 
+              status);
+fits_get_colnum(fptr, CASEINSEN, "ENERG_HI", &col, status);
+fits_read_col(fptr, TDOUBLE, col, nrows, 1, 1, NULL, t->energy + nrows, 
+              &anynul, status);
+return *status;
+}
+
+// returns the index of the grid value of parameter p closest to x
+static int tables_grid_index(const stokes_tables *t, int p, double x) {
+int i, ibest = 0;
+
+for (i = 1; i < t->nvals[p]; i++)
+  if (fabs(t->vals[p][i] - x) < fabs(t->vals[p][ibest] - x)) ibest = i;
+return ibest;
+}
+
+// reads the SPECTRA extensions of the table itab (UNPOL, HRPOL, 45DEG) into
+// the components itab*3+j, where j is the Stokes XFLT value of the extension
+static int tables_read_spectra(stokes_tables *t, fitsfile *fptr, int itab, 
+                               int *status) {
+char  extname[FLEN_VALUE], xflt[FLEN_VALUE];
+float paramval[NPAR], *row;
+long  nrows, r, g, e;
+int   hdu, nhdus, col_par, col_spec, anynul, j, p, found = 0;
+
+if ((row = (float *) malloc(t->nebin * sizeof(float))) == NULL) 
+  return *status = -1;
+fits_get_num_hdus(fptr, &nhdus, status);
+for (hdu = 2; hdu <= nhdus && !*status; hdu++) {
+  fits_movabs_hdu(fptr, hdu, NULL, status);
+  fits_read_key(fptr, TSTRING, "EXTNAME", extname, NULL, status);
+  if (*status == KEY_NO_EXIST) *status = 0;
+  else if (*status == 0 && !strcmp(extname, "SPECTRA")) {
+    j = 0;
+    fits_read_key(fptr, TSTRING, "XFLT0001", xflt, NULL, status);
+    if (*status == KEY_NO_EXIST) *status = 0;
+    else if (!*status && sscanf(xflt, "Stokes:%d", &j) != 1) j = -1;
+    if (j < 0 || j > 2) continue;
+    fits_get_num_rows(fptr, &nrows, status);
+    if (!*status && nrows != t->ngrid) {
+      stokes_write("stokes: the tables do not share the same parameter grid", 
+                   5);
+      *status = -1;
+    }
+    fits_get_colnum(fptr, CASEINSEN, "PARAMVAL", &col_par, status);
+    fits_get_colnum(fptr, CASEINSEN, "INTPSPEC", &col_spec, status);
+    for (r = 1; r <= nrows && !*status; r++) {
+      fits_read_col(fptr, TFLOAT, col_par, r, 1, t->nintparm, NULL, paramval,
+                    &anynul, status);
+      fits_read_col(fptr, TFLOAT, col_spec, r, 1, t->nebin, NULL, row,
+                    &anynul, status);
+      for (p = 0, g = 0; p < t->nintparm; p++) 
+        g += tables_grid_index(t, p, paramval[p]) * t->stride[p];
+      for (e = 0; e < t->nebin; e++) 
+        t->data[(g * t->nebin + e) * NCOMP + itab * 3 + j] = row[e];
+    }
+    found |= 1 << j;
+  }
+}
+free(row);
+if (!*status && found != 7) {
+  stokes_write("stokes: the tables do not contain all Stokes:0,1,2 spectra", 5);
+  *status = -1;
+}
+return *status;
+}
+
+/*******************************************************************************
+* Compact storage
+*
+* The HRPOL and 45DEG tables are used only with the UNPOL table subtracted and
+* Stokes parameter V is not tabulated at all. The components that are zero in
+* all table spectra (e.g. U of the UNPOL table, which vanishes by symmetry) 
+* are not stored and not interpolated, which does not change the results. 
+* "xset STOKESDISC_STORAGE diff" stores the HRPOL and 45DEG tables with the 
+* UNPOL table already subtracted (in single precision), so that also the 
+* differences vanishing by symmetry are dropped, and "xset STOKESDISC_STORAGE 
+* half" stores these differences in half precision, each spectrum scaled by 
+* its largest value. Both reduce the memory of the tables and the bytes read 
+* by every interpolation at the cost of rounding the table values, the 
+* largest rounding error of the half precision is reported when the tables 
+* are loaded. By default (full) the tables are stored as read.
+*******************************************************************************/
+
+static float half_values[65536];    // values of all half precision numbers
+
+// returns the half precision number nearest to |v| <= 1, with the sign of v
+static uint16_t half_encode(double v) {
+uint16_t sign = v < 0. ? 0x8000 : 0;
+double   a = fabs(v), f;
+int      x, m;
+
+if (a < ldexp(1., -14)) return sign | (uint16_t) nearbyint(ldexp(a, 24));
+f = frexp(a, &x);
+m = (int) nearbyint((2. * f - 1.) * 1024.);
+if (m == 1024) {
+  m = 0;
+  x++;
+}
+return sign | (uint16_t) ((x + 14) << 10) | (uint16_t) m;
+}
+
+// fills the table of the values of the half precision numbers
+static void half_init(void) {
+int h, x, m;
+
+for (h = 0; h < 65536; h++) {
+  x = (h >> 10) & 0x1f;
+  m = h & 0x3ff;
+  if (x == 0) half_values[h] = (float) ldexp(m, -24);
+  else if (x == 0x1f) half_values[h] = m ? NAN : INFINITY;
+  else half_values[h] = (float) ldexp(1024 + m, x - 25);
+  if (h & 0x8000) half_values[h] = -half_values[h];
+}
+}
+
+// converts the tables read as data[grid][bin][NCOMP] into the storage 
+// t->storage, returns 0 on success, 1 if there is not enough memory
+static int tables_pack(stokes_tables *t) {
+long   n = t->ngrid * t->nebin, i, g, e;
+float  *d = t->data, amax;
+double err, err_rel = 0., err_peak = 0.;
+int    j, k, comp[NCOMP];
+
+if (t->storage != STORAGE_FULL) 
+  for (i = 0; i < n; i++) 
+    for (j = 3; j < NCOMP; j++) d[i * NCOMP + j] -= d[i * NCOMP + j % 3];
+// the components that are zero everywhere are dropped
+t->ncomp = 0;
+for (j = 0; j < NCOMP; j++) {
+  for (i = 0; i < n && d[i * NCOMP + j] == 0.; i++) ;
+  t->index[j] = i < n ? t->ncomp : -1;
+  if (i < n) comp[t->ncomp++] = j;
+}
+if (t->storage != STORAGE_HALF) {
+  for (i = 0; i < n; i++) 
+    for (k = 0; k < t->ncomp; k++) d[i * t->ncomp + k] = d[i * NCOMP + comp[k]];
+  if (t->ncomp > 0 && t->ncomp < NCOMP && 
+      (d = (float *) realloc(t->data, n * t->ncomp * sizeof(float))) != NULL) 
+    t->data = d;
+  return 0;
+}
+t->half = (uint16_t *) malloc(n * t->ncomp * sizeof(uint16_t));
+t->scale = (float *) malloc(t->ngrid * t->ncomp * sizeof(float));
+if (t->half == NULL || t->scale == NULL) return 1;
+for (g = 0; g < t->ngrid; g++) 
+  for (k = 0; k < t->ncomp; k++) {
+    amax = 0.;
+    for (e = 0; e < t->nebin; e++) 
+      if (fabsf(d[(g * t->nebin + e) * NCOMP + comp[k]]) > amax) 
+        amax = fabsf(d[(g * t->nebin + e) * NCOMP + comp[k]]);
+    t->scale[g * t->ncomp + k] = amax > 0. ? amax : 1.;
+    for (e = 0; e < t->nebin; e++) {
+      i = g * t->nebin + e;
+      t->half[i * t->ncomp + k] = 
+        half_encode(d[i * NCOMP + comp[k]] / t->scale[g * t->ncomp + k]);
+      err = fabs(half_values[t->half[i * t->ncomp + k]] * 
+                 t->scale[g * t->ncomp + k] - d[i * NCOMP + comp[k]]);
+      if (err / t->scale[g * t->ncomp + k] > err_peak) 
+        err_peak = err / t->scale[g * t->ncomp + k];
+      if (d[i * NCOMP + comp[k]] != 0. && 
+          err / fabs(d[i * NCOMP + comp[k]]) > err_rel) 
+        err_rel = err / fabs(d[i * NCOMP + comp[k]]);
+    }
+  }
+free(t->data);
+t->data = NULL;
+t->half_error[0] = err_peak;
+t->half_error[1] = err_rel;
+return 0;
+}
+
+// reports the rounding errors of the half precision tables
+static void tables_report(const stokes_tables *t) {
+char errstr[160];
+
+if (t->storage != STORAGE_HALF) return;
+snprintf(errstr, sizeof(errstr), "stokes: half precision tables, largest "
+         "error %.2e of the spectrum maximum, %.2e of the value", 
+         t->half_error[0], t->half_error[1]);
+stokes_write(errstr, 10);
+}
+
+/*******************************************************************************
+* Preprocessed tables
+*
+* After the tables are read from the FITS files for the first time, they are 
+* written in the native layout into REFBINARY (REFBINARY_DIFF, REFBINARY_HALF
+* for the compact storage) next to the FITS files, which 
+* later sessions map into memory read-only. All processes on one node then 
+* share one copy of the tables in the page cache instead of each parsing the 
+* FITS files into private memory. The file is versioned, every array in it is 
+* aligned to BINARY_ALIGN bytes and it records the sizes and modification 
+* times of the FITS files it was made from, so that it is ignored (and 
+* rewritten) when the FITS files change. "xset STOKESDISC_BINARY off" switches 
+* the preprocessed tables off.
+*
+* The mapped tables are read on demand. The spectra of every grid point are 
+* contiguous, so only the grid points at the corners of the bracketing cells 
+* (i.e. the slabs of the cos_incl, PhoIndex and Size values actually 
+* reached by the fits) are read from the disc and kept in memory. The 
+* read-ahead of the neighbouring pages is switched off and the corners of 
+* every newly blended cell are requested together before they are blended.
+*******************************************************************************/
+
+#define BINARY_MAGIC   "STKDISC"
+#define BINARY_VERSION 2
+#define BINARY_ORDER   0x01020304
+#define BINARY_ALIGN   64
+
+typedef struct {
+  char    magic[8];              // BINARY_MAGIC
+  int32_t version;               // BINARY_VERSION
+  int32_t order;                 // BINARY_ORDER in the byte order of the file
+  int32_t ncomp;                 // NCOMP
+  int32_t nintparm;              // number of interpolated parameters
+  int32_t redshift;              // 1 if the last parameter is redshift
+  int32_t nebin;                 // number of table energy bins
+  int32_t nvals[NPAR];           // number of grid values of each parameter
+  int32_t method[NPAR];          // interpolation method of each parameter
+  int32_t storage;               // storage of the table data
+  int32_t nstored;               // number of stored components
+  int32_t index[NCOMP];          // stored index of each component
+  double  half_error[2];         // rounding errors of the half precision
+  int64_t ngrid;                 // number of grid points
+  int64_t src_size[NTABLES];     // sizes of the FITS tables
+  int64_t src_mtime[NTABLES];    // modification times of the FITS tables
+  int64_t off_vals[NPAR];        // offset of the grid values of each parameter
+  int64_t off_energy;            // offset of the energy bin edges
+  int64_t off_data;              // offset of the table data
+  int64_t off_scale;             // offset of the scales of the half data
+  int64_t size;                  // size of the whole file
+} binary_header;
+
+// offset of the next aligned array after off
+static int64_t binary_align(int64_t off) {
+return (off + BINARY_ALIGN - 1) / BINARY_ALIGN * BINARY_ALIGN;
+}
+
+// fills the part of the header identifying the FITS tables,
+// returns 0 on success, 1 if some table cannot be accessed
+static int binary_sources(binary_header *h, const table_paths *paths) {
+struct stat st;
+int         i;
+
+for (i = 0; i < NTABLES; i++) {
+  if (stat(paths->refspectra[i], &st)) return 1;
+  h->src_size[i] = (int64_t) st.st_size;
+  h->src_mtime[i] = (int64_t) st.st_mtime;
+}
+return 0;
+}
+
+// maps the preprocessed tables of the storage t->storage into memory,
+// returns 0 on success, 1 if they are missing, outdated or unreadable
+static int tables_map_binary(stokes_tables *t, const table_paths *paths) {
+const char          *binary = paths->binary[t->storage];
+binary_header       src, h;
+struct stat         st;
+const char          *base;
+void                *map;
+int                 fd, p;
+
+if (!strlen(binary) || binary_sources(&src, paths)) return 1;
+if ((fd = open(binary, O_RDONLY)) < 0) return 1;
+if (fstat(fd, &st) || (size_t) st.st_size < sizeof(h) ||
+    read(fd, &h, sizeof(h)) != (ssize_t) sizeof(h) ||
+    memcmp(h.magic, BINARY_MAGIC, sizeof(h.magic)) || 
+    h.version != BINARY_VERSION || h.order != BINARY_ORDER || 
+    h.ncomp != NCOMP || h.storage != t->storage || 
+    h.size != (int64_t) st.st_size ||
+    memcmp(h.src_size, src.src_size, sizeof(h.src_size)) || 
+    memcmp(h.src_mtime, src.src_mtime, sizeof(h.src_mtime))) {
+  close(fd);
+  return 1;
+}
+map = mmap(NULL, (size_t) h.size, PROT_READ, MAP_SHARED, fd, 0);
+close(fd);
+if (map == MAP_FAILED) return 1;
+posix_madvise(map, (size_t) h.size, POSIX_MADV_RANDOM);
+base = (const char *) map;
+t->map = map;
+t->map_size = (size_t) h.size;
+t->nintparm = h.nintparm;
+t->redshift = h.redshift;
+t->nebin = h.nebin;
+t->ngrid = (long) h.ngrid;
+for (p = 0; p < NPAR; p++) {
+  t->nvals[p] = h.nvals[p];
+  t->method[p] = h.method[p];
+  t->vals[p] = p < h.nintparm ? (double *) (base + h.off_vals[p]) : NULL;
+}
+for (p = t->nintparm - 1; p >= 0; p--) 
+  t->stride[p] = p == t->nintparm - 1 ? 1 : t->stride[p + 1] * t->nvals[p + 1];
+t->energy = (double *) (base + h.off_energy);
+t->ncomp = h.nstored;
+memcpy(t->index, h.index, sizeof(t->index));
+if (t->storage == STORAGE_HALF) {
+  t->half = (uint16_t *) (base + h.off_data);
+  t->scale = (float *) (base + h.off_scale);
+  memcpy(t->half_error, h.half_error, sizeof(t->half_error));
+} else t->data = (float *) (base + h.off_data);
+return 0;
+}
+
+// writes an array at the offset off of the file, padded to alignment
+static int binary_write_array(FILE *fw, int64_t off, const void *data, 
+                              size_t size) {
+static const char zero[BINARY_ALIGN] = {0};
+long pad = (long) (off - ftell(fw));
+
+if (pad < 0 || fwrite(zero, 1, pad, fw) != (size_t) pad) return 1;
+return fwrite(data, 1, size, fw) != size;
+}
+
+// writes the tables read from the FITS files into the preprocessed file,
+// the file is written under a temporary name and renamed when complete,
+// returns 0 on success
+static int tables_write_binary(const stokes_tables *t, 
+                               const table_paths *paths) {
+const char    *binary = paths->binary[t->storage];
+binary_header h;
+char          tmpname[PATH_LEN + 32], errstr[PATH_LEN + 64];
+FILE          *fw;
+int64_t       off;
+size_t        size, esize;
+int           p, err;
+
+if (!strlen(binary)) return 1;
+memset(&h, 0, sizeof(h));
+if (binary_sources(&h, paths)) return 1;
+memcpy(h.magic, BINARY_MAGIC, sizeof(h.magic));
+h.version = BINARY_VERSION;
+h.order = BINARY_ORDER;
+h.ncomp = NCOMP;
+h.nintparm = t->nintparm;
+h.redshift = t->redshift;
+h.nebin = t->nebin;
+h.ngrid = t->ngrid;
+h.storage = t->storage;
+h.nstored = t->ncomp;
+memcpy(h.index, t->index, sizeof(h.index));
+memcpy(h.half_error, t->half_error, sizeof(h.half_error));
+esize = t->storage == STORAGE_HALF ? sizeof(uint16_t) : sizeof(float);
+size = (size_t) t->ngrid * t->nebin * t->ncomp * esize;
+off = binary_align(sizeof(h));
+for (p = 0; p < t->nintparm; p++) {
+  h.nvals[p] = t->nvals[p];
+  h.method[p] = t->method[p];
+  h.off_vals[p] = off;
+  off = binary_align(off + t->nvals[p] * sizeof(double));
+}
+h.off_energy = off;
+off = binary_align(off + (t->nebin + 1) * sizeof(double));
+h.off_data = off;
+h.size = off + (int64_t) size;
+if (t->storage == STORAGE_HALF) {
+  h.off_scale = binary_align(h.size);
+  h.size = h.off_scale + (int64_t) t->ngrid * t->ncomp * sizeof(float);
+}
+snprintf(tmpname, sizeof(tmpname), "%s.%ld.tmp", binary, (long) getpid());
+if ((fw = fopen(tmpname, "wb")) == NULL) return 1;
+err = fwrite(&h, sizeof(h), 1, fw) != 1;
+for (p = 0; p < t->nintparm && !err; p++) 
+  err = binary_write_array(fw, h.off_vals[p], t->vals[p], 
+                           t->nvals[p] * sizeof(double));
+if (!err) err = binary_write_array(fw, h.off_energy, t->energy, 
+                                   (t->nebin + 1) * sizeof(double));
+if (!err) err = binary_write_array(fw, h.off_data, 
+                                   t->storage == STORAGE_HALF ? 
+                                   (const void *) t->half : t->data, size);
+if (!err && t->storage == STORAGE_HALF) 
+  err = binary_write_array(fw, h.off_scale, t->scale, 
+                           (size_t) t->ngrid * t->ncomp * sizeof(float));
+if (fclose(fw)) err = 1;
+if (!err) err = rename(tmpname, binary) != 0;
+if (err) {
+  remove(tmpname);
+  return 1;
+}
+snprintf(errstr, sizeof(errstr), "stokes: preprocessed tables written to %s", 
+         binary);
+stokes_write(errstr, 10);
+return 0;
+}
+
+// reads the three tables from the FITS files into the storage t->storage,
+// returns 0 on success, otherwise the error status
+static int tables_read_fits(stokes_tables *t, const table_paths *paths) {
+fitsfile *fptr;
+char     errstr[PATH_LEN + 64], fitserr[FLEN_STATUS];
+int      i, status = 0, close_status;
+
+for (i = 0; i < NTABLES && !status; i++) {
+  fits_open_file(&fptr, paths->refspectra[i], READONLY, &status);
+  if (!status) {
+    if (i > 0 || !tables_read_grid(t, fptr, &status))
+      tables_read_spectra(t, fptr, i, &status);
+    close_status = 0;
+    fits_close_file(fptr, &close_status);
+  }
+  if (status) {
+    if (status > 0) fits_get_errstatus(status, fitserr);
+    else strcpy(fitserr, "unexpected table format");
+    snprintf(errstr, sizeof(errstr), "stokes: error reading %s: %s", 
+             paths->refspectra[i], fitserr);
+    stokes_write(errstr, 5);
+    tables_free(t);
+  }
+}
+if (!status && tables_pack(t)) {
+  stokes_write("stokes: not enough memory for the tables", 5);
+  tables_free(t);
+  status = -1;
+}
+return status;
+}
+
+// reads the three tables from the preprocessed file if it is valid, 
+// otherwise from the FITS files, returns 0 if the tables are ready, 1 otherwise
+static int tables_load(stokes_tables *t, const table_paths *paths) {
+int status, binary;
+
+tables_free(t);
+if (t->storage == STORAGE_HALF && half_values[0x3c00] != 1.) half_init();
+binary = strcmp(settings[SET_BINARY], "off") && 
+         strcmp(settings[SET_BINARY], "OFF");
+if (binary && !tables_map_binary(t, paths)) {
+  tables_report(t);
+  t->state = 1;
+  return 0;
+}
+status = tables_read_fits(t, paths);
+// write the preprocessed tables and use them instead of the private copy
+if (!status && binary && !tables_write_binary(t, paths)) {
+  tables_free(t);
+  if (tables_map_binary(t, paths)) status = tables_read_fits(t, paths);
+}
+if (status) 
+  stokes_write("stokes: tabintxflt will be used for the interpolation", 5);
+else tables_report(t);
+t->state = !status;
+return t->state != 1;
+}
+
+// returns the tables for the table paths in the given storage, loading them 
+// if they are not loaded yet or, if retry is set, if their loading failed 
+// before, returns NULL if the tables cannot be loaded
+static stokes_tables* tables_get(const table_paths *paths, int storage, 
+                                 int retry) {
+stokes_tables *t = NULL;
+int           k;
+
+pthread_mutex_lock(&tables_lock);
+for (k = 0; k < TABLE_SETS && t == NULL; k++) 
+  if (!strcmp(table_sets[k].source, paths->refspectra[0]) && 
+      table_sets[k].storage == storage) t = &table_sets[k];
+for (k = 0; k < TABLE_SETS && t == NULL; k++) 
+  if (!strlen(table_sets[k].source)) {
+    t = &table_sets[k];
+    strcpy(t->source, paths->refspectra[0]);
+    t->storage = storage;
+    t->state = -1;
+  }
+if (t == NULL) 
+  stokes_write("stokes: too many table directories, tabintxflt will be used", 
+               5);
+else {
+  if (t->state == 0 && retry) t->state = -1;
+  if (t->state < 0) tables_load(t, paths);
+  if (t->state != 1) t = NULL;
+}
+pthread_mutex_unlock(&tables_lock);
+return t;
+}
+
+/*******************************************************************************
+* Rebinning plans
+*
+* The rebinning of the blended table spectrum onto the model energy grid 
+* depends only on the grid, on the redshift and on the table energy bins. It 
+* is therefore computed once into a plan, i.e. the list of the overlapping 
+* table bins and their weights for every model bin, which is kept for up to 
+* PLAN_SLOTS energy grids (e.g. of the I, Q and U spectra of one fit) and 
+* reused by all nine components and by the later evaluations. A plan has at 
+* most ne + nebin entries. Every evaluation context has its own plans.
+*
+* The redshift zshift is not a table grid axis, it only scales the energies 
+* of the table bins. The blended table spectrum of the last evaluation is 
+* therefore kept with its Size, PhoIndex and cos_incl, and when only zshift 
+* changes (e.g. in fits of the Doppler shift of a static source) the tables 
+* are only rebinned onto the shifted energy grid, without blending them anew.
+*******************************************************************************/
+
+#define PLAN_SLOTS 4
+
+typedef struct {
+  int                 ne;       // number of energy bins (0 - empty plan)
+  unsigned long       hash;     // hash of the energy grid
+  unsigned long       used;     // time of the last use
+  double             *ear;      // energy grid, ear[ne+1]
+  double              zfac;     // 1 + redshift applied to the energies
+  const stokes_tables *tables;  // tables of the plan
+  int                *first;    // entries of bin ie: first[ie]...first[ie+1]-1
+  int                *bin;      // table energy bin of each entry
+  double             *weight;   // weight of each entry
+} rebin_plan;
+
+typedef struct {
+  rebin_plan    plan[PLAN_SLOTS];
+  unsigned long clock;          // counter of the uses of the plans
+} rebin_plans;
+
+typedef struct {
+  const stokes_tables *tables;  // tables of the blended spectrum
+  double              par[NPAR]; // interpolated parameters of the spectrum
+  int                 mask;     // bits of the blended components
+} blend_key;
+
+// releases the memory of the plan
+static void rebin_plan_free(rebin_plan *r) {
+free(r->ear);
+free(r->first);
+free(r->bin);
+free(r->weight);
+r->ear = r->weight = NULL;
+r->first = r->bin = NULL;
+r->ne = 0;
+}
+
+// releases the memory of all plans
+static void rebin_plans_free(rebin_plans *plans) {
+int k;
+
+for (k = 0; k < PLAN_SLOTS; k++) rebin_plan_free(&plans->plan[k]);
+}
+
+// computes the plan of the rebinning of the table energy bins, shifted by 
+// zfac = 1 + redshift, onto the energy grid ear[ne+1]
+static void rebin_plan_build(rebin_plan *r, const stokes_tables *t,
+                             const double *ear, int ne, double zfac) {
+double elo, ehi, de, overlap;
+int    e, ie, n = 0;
+
+e = 0;
+for (ie = 0; ie < ne; ie++) {
+  elo = ear[ie] * zfac;
+  ehi = ear[ie + 1] * zfac;
+  r->first[ie] = n;
+  while (e < t->nebin && t->energy[e + 1] <= elo) e++;
+  for (; e < t->nebin && t->energy[e] < ehi; e++) {
+    de = t->energy[e + 1] - t->energy[e];
+    overlap = (t->energy[e + 1] < ehi ? t->energy[e + 1] : ehi) - 
+              (t->energy[e] > elo ? t->energy[e] : elo);
+    if (overlap > 0. && de > 0.) {
+      r->bin[n] = e;
+      r->weight[n++] = overlap / de;
+    }
+    if (t->energy[e + 1] > ehi) break;
+  }
+}
+r->first[ne] = n;
+}
+
+// returns the plan of the rebinning of the tables onto the energy grid ear 
+// (with the hash of the grid) shifted by zfac, computing it if it is not kept 
+// yet in place of the least recently used one, returns NULL if there is not 
+// enough memory
+static const rebin_plan* rebin_plans_get(rebin_plans *plans, 
+                                         const stokes_tables *t, 
+                                         const double *ear, int ne, 
+                                         unsigned long hash, double zfac) {
+rebin_plan *r = NULL;
+int        k;
+
+for (k = 0; k < PLAN_SLOTS; k++) {
+  r = &plans->plan[k];
+  if (r->ne == ne && r->hash == hash && r->zfac == zfac && r->tables == t &&
+      !memcmp(r->ear, ear, (ne + 1) * sizeof(double))) {
+    r->used = ++plans->clock;
+    return r;
+  }
+}
+r = &plans->plan[0];
+for (k = 1; k < PLAN_SLOTS && r->ne; k++) 
+  if (!plans->plan[k].ne || plans->plan[k].used < r->used) r = &plans->plan[k];
+rebin_plan_free(r);
+r->ear = (double *) malloc((ne + 1) * sizeof(double));
+r->first = (int *) malloc((ne + 1) * sizeof(int));
+r->bin = (int *) malloc(((long) ne + t->nebin) * sizeof(int));
+r->weight = (double *) malloc(((long) ne + t->nebin) * sizeof(double));
+if (r->ear == NULL || r->first == NULL || r->bin == NULL || r->weight == NULL) {
+  rebin_plan_free(r);
+  return NULL;
+}
+rebin_plan_build(r, t, ear, ne, zfac);
+memcpy(r->ear, ear, (ne + 1) * sizeof(double));
+r->ne = ne;
+r->hash = hash;
+r->zfac = zfac;
+r->tables = t;
+r->used = ++plans->clock;
+return r;
+}
+
+// requests the pages of the mapped tables holding the spectra of the ncorner 
+// grid points cg[] at once
+static void tables_prefetch(const stokes_tables *t, int ncorner, 
+                            const long *cg) {
+const char *base = t->storage == STORAGE_HALF ? (const char *) t->half 
+                                              : (const char *) t->data;
+size_t     size, page = (size_t) sysconf(_SC_PAGESIZE);
+uintptr_t  lo;
+int        c;
+
+if (t->map == NULL) return;
+size = (size_t) t->nebin * t->ncomp * 
+       (t->storage == STORAGE_HALF ? sizeof(uint16_t) : sizeof(float));
+for (c = 0; c < ncorner; c++) {
+  lo = (uintptr_t) (base + cg[c] * size) / page * page;
+  posix_madvise((void *) lo, (uintptr_t) (base + cg[c] * size) + size - lo, 
+                POSIX_MADV_WILLNEED);
+}
+}
+
+// blends the table energy bins e0 ... e1-1 of the selected stored components 
+// comp[] of the ncorner corners of the grid cell with the weights cw[] and the 
+// grid points cg[] into spec[bin][stored component], the other components of
+// spec[] are kept
+static void tables_blend(const stokes_tables *t, int ncorner, 
+                         const double *cw, const long *cg, int ncomp, 
+                         const int *comp, int e0, int e1, double *spec) {
+const float    *d, *sc;
+const uint16_t *h;
+double         wk[NCOMP];
+int            n = t->ncomp, c, e, k;
+
+if (ncomp == n) 
+  for (e = e0 * n; e < e1 * n; e++) spec[e] = 0.;
+else 
+  for (e = e0 * n; e < e1 * n; e += n)
+    for (k = 0; k < ncomp; k++) spec[e + comp[k]] = 0.;
+for (c = 0; c < ncorner; c++) {
+  if (t->storage == STORAGE_HALF) {
+    h = t->half + cg[c] * t->nebin * n;
+    sc = t->scale + cg[c] * n;
+    for (k = 0; k < ncomp; k++) wk[k] = cw[c] * sc[comp[k]];
+    for (e = e0 * n; e < e1 * n; e += n)
+      for (k = 0; k < ncomp; k++) 
+        spec[e + comp[k]] += wk[k] * half_values[h[e + comp[k]]];
+    continue;
+  }
+  d = t->data + cg[c] * t->nebin * n;
+  if (ncomp == n) 
+    for (e = e0 * n; e < e1 * n; e++) spec[e] += cw[c] * d[e];
+  else 
+    for (e = e0 * n; e < e1 * n; e += n)
+      for (k = 0; k < ncomp; k++) spec[e + comp[k]] += cw[c] * d[e + comp[k]];
+}
+}
+
+// rebins the blended components comp[] (stored as scomp[] of the nstored 
+// components of spec[]) onto the model energy bins ie0 ... ie1-1 by the plan 
+// r and rounds them to single precision if single is set
+static void tables_rebin(const rebin_plan *r, const double *spec, int nstored,
+                         int single, int ncomp, const int *comp, 
+                         const int *scomp, int ie0, int ie1, double *smatrix) {
+const double *w = r->weight;
+const int    *b = r->bin;
+double       sum[NCOMP];
+int          ne = r->ne, j, k, ie;
+
+for (ie = ie0; ie < ie1; ie++) {
+  for (k = 0; k < ncomp; k++) sum[k] = 0.;
+  for (j = r->first[ie]; j < r->first[ie + 1]; j++) 
+    for (k = 0; k < ncomp; k++) 
+      sum[k] += spec[b[j] * nstored + scomp[k]] * w[j];
+  if (single)
+    for (k = 0; k < ncomp; k++) 
+      smatrix[comp[k] * ne + ie] = (float) (sum[k] / r->zfac);
+  else 
+    for (k = 0; k < ncomp; k++) smatrix[comp[k] * ne + ie] = sum[k] / r->zfac;
+}
+}
+
+// computes the corners cg[] of the table grid cell bracketing the parameters 
+// par (Size, PhoIndex, cos_incl, zshift) with non-zero interpolation weights 
+// cw[], returns the number of the corners
+static int tables_corners(const stokes_tables *t, const double *par, 
+                          double *cw, long *cg) {
+double frac[NPAR], w, x;
+long   idx[NPAR], g;
+int    p, c, ncorner, lo, hi, mid;
+
+// bracketing grid values and interpolation weights of each parameter
+for (p = 0; p < t->nintparm; p++) {
+  idx[p] = 0;
+  frac[p] = 0.;
+  if (t->nvals[p] < 2) continue;
+  x = par[p];
+  if (x <= t->vals[p][0]) x = t->vals[p][0];
+  if (x >= t->vals[p][t->nvals[p] - 1]) x = t->vals[p][t->nvals[p] - 1];
+  lo = 0;
+  hi = t->nvals[p] - 1;
+  while (hi - lo > 1) {
+    mid = (lo + hi) / 2;
+    if (t->vals[p][mid] > x) hi = mid;
+    else lo = mid;
+  }
+  idx[p] = lo;
+  if (t->method[p] == 1 && t->vals[p][lo] > 0. && x > 0.)
+    frac[p] = log(x / t->vals[p][lo]) / log(t->vals[p][hi] / t->vals[p][lo]);
+  else frac[p] = (x - t->vals[p][lo]) / (t->vals[p][hi] - t->vals[p][lo]);
+}
+// the corners of the bracketing cell with non-zero weights
+ncorner = 0;
+for (c = 0; c < (1 << t->nintparm); c++) {
+  w = 1.;
+  g = 0;
+  for (p = 0; p < t->nintparm; p++) {
+    if ((c >> p) & 1) {
+      w *= frac[p];
+      g += (idx[p] + 1) * t->stride[p];
+    } else {
+      w *= 1. - frac[p];
+      g += idx[p] * t->stride[p];
+    }
+  }
+  if (w == 0.) continue;
+  cw[ncorner] = w;
+  cg[ncorner++] = g;
+}
+return ncorner;
+}
+
+// interpolates the components of the tables selected by the bits of mask for
+// the parameters par (Size, PhoIndex, cos_incl, zshift) and rebins them onto 
+// the energy grid ear (with the hash of the grid), rounded to single precision
+// if single is set, spec[nebin*NCOMP] is the work array for the blended table 
+// spectrum with the key, returns 1 if there is not enough memory for the 
+// rebinning plan
+static int tables_interpolate(const stokes_tables *t, rebin_plans *plans, 
+                              const double *ear, int ne, unsigned long hash,
+                              const double *par, int single, int mask, 
+                              double *spec, blend_key *key, double *smatrix) {
+const rebin_plan *r;
+double cw[1 << NPAR], zfac;
+long   cg[1 << NPAR];
+int    c, n, ncorner, k, ncomp, nb;
+int    comp[NCOMP], scomp[NCOMP], bcomp[NCOMP];
+
+// the components that are not stored are zero
+for (k = 0, ncomp = 0; k < NCOMP; k++) {
+  if (!((mask >> k) & 1)) continue;
+  if (t->index[k] < 0) memset(smatrix + k * ne, 0, ne * sizeof(double));
+  else {
+    scomp[ncomp] = t->index[k];
+    comp[ncomp++] = k;
+  }
+}
+// the components already blended for these parameters are only rebinned
+if (key->tables != t || memcmp(key->par, par, t->nintparm * sizeof(double))) {
+  key->tables = t;
+  memcpy(key->par, par, t->nintparm * sizeof(double));
+  key->mask = 0;
+}
+for (k = 0, nb = 0; k < ncomp; k++) 
+  if (!((key->mask >> comp[k]) & 1)) bcomp[nb++] = scomp[k];
+
+ncorner = tables_corners(t, par, cw, cg);
+// blend the corners on the table energy bins and rebin onto the model energy 
+// grid, shifted by the redshift, both split over the threads by energy
+zfac = t->redshift ? 1. + par[t->nintparm] : 1.;
+if ((r = rebin_plans_get(plans, t, ear, ne, hash, zfac)) == NULL) return 1;
+n = par_threads;
+if (nb) {
+  tables_prefetch(t, ncorner, cg);
+  PARALLEL_FOR
+  for (c = 0; c < n; c++) 
+    tables_blend(t, ncorner, cw, cg, nb, bcomp, par_first(t->nebin, c, n), 
+                 par_first(t->nebin, c + 1, n), spec);
+  key->mask |= mask;
+}
+PARALLEL_FOR
+for (c = 0; c < n; c++) 
+  tables_rebin(r, spec, t->ncomp, single, ncomp, comp, scomp, 
+               par_first(ne, c, n), par_first(ne, c + 1, n), smatrix);
+return 0;
+}
+
+// returns the index of the lower corner of the table grid cell containing 
+// the model parameters param (Size, PhoIndex, cos_incl, ..., zshift)
+static long tables_cell(const stokes_tables *t, const double *param) {
+const double x[NPAR] = {param[0], param[1], param[2], param[6]};
+long         g = 0;
+int          p, lo, hi, mid;
+
+for (p = 0; p < t->nintparm; p++) {
+  lo = 0;
+  hi = t->nvals[p] - 1;
+  while (hi - lo > 1) {
+    mid = (lo + hi) / 2;
+    if (t->vals[p][mid] > x[p]) hi = mid;
+    else lo = mid;
+  }
+  g += lo * t->stride[p];
+}
+return g;
+}
+
+/*******************************************************************************
+* Cache of the interpolated tables
+*
+* The nine interpolated table components (three tables times three Stokes 
+* parameters) depend only on the energy grid, on the table files and on the 
+* Size, PhoIndex, cos_incl and zshift parameters, i.e. they need not be 
+* recomputed when only pol_deg, chi or pos_ang change. The HRPOL and 45DEG 
+* components are stored already with the UNPOL components subtracted. Only the
+* components needed for the requested output are interpolated, the missing 
+* ones are added to the same slot when they are needed later.
+*
+* XSPEC evaluates the model in turn for several data sets (e.g. I, Q and U 
+* spectra with their own energy grids) and, during derivative and error 
+* calculations, for several nearby parameter sets, therefore up to CACHE_SLOTS 
+* results are kept and the least recently used one is replaced. The memory 
+* used by the cache is limited by "xset STOKESDISC_CACHE_MB <size in MB>",
+* the most recent result is always kept. Every evaluation context has its own
+* cache.
+*******************************************************************************/
+
+#define CACHE_SLOTS 16
+#define CACHE_MB    64.
+
+typedef struct {
+  int           ne;             // number of energy bins (0 - empty slot)
+  int           mask;           // bits of the valid components
+  int           ifl;            // data set (spectrum) number
+  unsigned long hash;           // hash of the energy grid
+  unsigned long used;           // time of the last use
+  unsigned long stored;         // time the key was stored
+  double       *ear;            // energy grid, ear[ne+1]
+  double        param[NPAR];    // Size, PhoIndex, cos_incl, zshift
+  long          paths_gen;      // generation of the table paths
+  int           engine;         // ENGINE_NATIVE or ENGINE_XSPEC
+  double       *smatrix;        // interpolated components, smatrix[NCOMP*ne]
+} smatrix_slot;
+
+typedef struct {
+  smatrix_slot  slot[CACHE_SLOTS];
+  unsigned long clock;          // counter of the uses of the slots
+} smatrix_cache;
+
+// memory occupied by the slot with ne energy bins
+static size_t smatrix_slot_size(int ne) {
+return (ne + 1) * sizeof(double) + NCOMP * ne * sizeof(double);
+}
+
+// hash of the energy grid, the FNV-1a step applied to the 64-bit words of the 
+// grid in four independent lanes (i.e. fixed blocks of four bins without the 
+// serial dependence of one chain), the lanes folded together at the end; two 
+// grids of equal hashes are still compared in full by the callers
+#define HASH_LANES 4
+static unsigned long ear_hash(const double *ear, int ne) {
+uint64_t h[HASH_LANES], w;
+int      k, l, n = ne + 1;
+
+for (l = 0; l < HASH_LANES; l++) h[l] = 14695981039346656037ULL + l;
+for (k = 0; k + HASH_LANES <= n; k += HASH_LANES)
+  for (l = 0; l < HASH_LANES; l++) {
+    memcpy(&w, ear + k + l, sizeof(w));
+    h[l] = (h[l] ^ w) * 1099511628211ULL;
+    h[l] ^= h[l] >> 29;
+  }
+for (; k < n; k++) {
+  memcpy(&w, ear + k, sizeof(w));
+  h[0] = (h[0] ^ w) * 1099511628211ULL;
+  h[0] ^= h[0] >> 29;
+}
+for (l = 1; l < HASH_LANES; l++) h[0] = (h[0] ^ h[l]) * 1099511628211ULL;
+return (unsigned long) (h[0] ^ h[0] >> 32);
+}
+
+// returns the slot holding the components for the given data set, energy 
+// grid, parameters and tables, NULL if there is no such slot
+static smatrix_slot* smatrix_cache_find(smatrix_cache *cache, int ifl,
+                                        unsigned long hash, 
+                                        const double *ear, int ne,
+                                        const double *par, 
+                                        long paths_gen, int engine) {
+smatrix_slot *c;
+int          k;
+
+for (k = 0; k < CACHE_SLOTS; k++) {
+  c = &cache->slot[k];
+  if (c->ne != ne || c->ifl != ifl || c->hash != hash)
+    continue;
+  if (memcmp(c->param, par, NPAR * sizeof(double))) continue;
+  if (c->paths_gen != paths_gen || c->engine != engine) continue;
+  if (memcmp(c->ear, ear, (ne + 1) * sizeof(double))) continue;
+  c->used = ++cache->clock;
+  return c;
+}
+return NULL;
+}
+
+// releases the memory of the slot
+static void smatrix_slot_free(smatrix_slot *c) {
+free(c->ear);
+free(c->smatrix);
+c->ear = NULL;
+c->smatrix = NULL;
+c->ne = 0;
+c->mask = 0;
+}
+
+// releases the memory of all slots
+static void smatrix_cache_free(smatrix_cache *cache) {
+int k;
+
+for (k = 0; k < CACHE_SLOTS; k++) smatrix_slot_free(&cache->slot[k]);
+}
+
+// returns an empty slot with room for ne energy bins, the least recently used 
+// slots are released so that the whole cache fits into the memory limit,
+// returns NULL if there is not enough memory
+static smatrix_slot* smatrix_cache_reserve(smatrix_cache *cache, int ne) {
+smatrix_slot *c, *lru;
+double       limit_mb;
+size_t       limit, total;
+int          k;
+
+limit_mb = CACHE_MB;
+if (strlen(settings[SET_CACHE_MB])) limit_mb = atof(settings[SET_CACHE_MB]);
+limit = limit_mb > 0. ? (size_t) (limit_mb * 1024. * 1024.) : 0;
+// release the least recently used slots until the new one fits
+while (1) {
+  total = smatrix_slot_size(ne);
+  lru = NULL;
+  for (k = 0; k < CACHE_SLOTS; k++) {
+    c = &cache->slot[k];
+    if (!c->ne) continue;
+    total += smatrix_slot_size(c->ne);
+    if (lru == NULL || c->used < lru->used) lru = c;
+  }
+  if (lru == NULL || total <= limit) break;
+  smatrix_slot_free(lru);
+}
+// take an empty slot, or the least recently used one if all are occupied
+c = NULL;
+for (k = 0; k < CACHE_SLOTS; k++) {
+  if (!cache->slot[k].ne) {
+    c = &cache->slot[k];
+    break;
+  }
+  if (c == NULL || cache->slot[k].used < c->used) c = &cache->slot[k];
+}
+if (c->ne != ne) {
+  smatrix_slot_free(c);
+  c->ear = (double *) malloc((ne + 1) * sizeof(double));
+  c->smatrix = (double *) malloc(NCOMP * ne * sizeof(double));
+  if (c->ear == NULL || c->smatrix == NULL) {
+    smatrix_slot_free(c);
+    return NULL;
+  }
+}
+c->ne = ne;
+c->mask = 0;
+return c;
+}
+
+// stores the key of the components that will be computed into c->smatrix
+static void smatrix_cache_store(smatrix_cache *cache, smatrix_slot *c, 
+                                int ifl, unsigned long hash, 
+                                const double *ear, int ne,
+                                const double *par, long paths_gen,
+                                int engine) {
+c->ifl = ifl;
+c->hash = hash;
+memcpy(c->ear, ear, (ne + 1) * sizeof(double));
+memcpy(c->param, par, NPAR * sizeof(double));
+c->paths_gen = paths_gen;
+c->engine = engine;
+c->mask = 0;
+c->used = c->stored = ++cache->clock;
+}
+
+/*******************************************************************************
+* Workspace
+*
+* The per-bin work arrays are kept in one persistent heap block aligned to 
+* WS_ALIGN bytes, which is reused between the calls and reallocated only when 
+* the number of energy bins grows, i.e. large energy grids do not need large 
+* stack. The blended spectrum of the native tables has its own array. Every
+* evaluation context has its own workspace.
+*******************************************************************************/
+
+#define WS_ALIGN 64
+#define WS_NDBL  8
+#define WS_NFLT  3
+
+typedef struct {
+  int     capacity;       // number of energy bins the workspace has room for
+  void   *block;          // the whole aligned memory block
+  double *far, *qar_final, *uar_final, *var, *pd, *pa, *pa2;
+  double *ear_single;     // energy grid rounded to single precision
+  float  *fl_ear;         // energy grid in single precision, fl_ear[ne+1]
+  float  *fl_photar;      // table interpolated by tabintxflt
+  float  *fl_photer;      // (unused) errors of the interpolated tables
+  long   spec_capacity;   // size of the blended spectrum array
+  double *spec;           // blended spectrum of the native tables
+  blend_key spec_key;     // parameters and components of the spectrum
+} workspace;
+
+// releases the memory of the workspace
+static void workspace_free(workspace *w) {
+free(w->block);
+free(w->spec);
+w->block = NULL;
+w->spec = NULL;
+w->capacity = 0;
+w->spec_capacity = 0;
+}
+
+// makes room for ne energy bins and for the blended spectrum of nspec values
+// in the workspace, returns 0 on success, 1 if there is not enough memory
+static int workspace_reserve(workspace *w, int ne, long nspec) {
+double **dbl[WS_NDBL] = {&w->far, &w->qar_final, &w->uar_final, &w->var, 
+                         &w->pd, &w->pa, &w->pa2, &w->ear_single};
+float  **flt[WS_NFLT] = {&w->fl_ear, &w->fl_photar, &w->fl_photer};
+size_t ndbl, nflt;
+char   *p;
+int    k;
+
+if (nspec > w->spec_capacity) {
+  free(w->spec);
+  w->spec_capacity = 0;
+  w->spec_key.tables = NULL;
+  if ((w->spec = (double *) malloc(nspec * sizeof(double))) == NULL) return 1;
+  w->spec_capacity = nspec;
+}
+if (ne <= w->capacity) return 0;
+// every array starts at an aligned address and has room for ne+1 bins
+ndbl = ((ne + 1) * sizeof(double) + WS_ALIGN - 1) / WS_ALIGN * WS_ALIGN;
+nflt = ((ne + 1) * sizeof(float) + WS_ALIGN - 1) / WS_ALIGN * WS_ALIGN;
+free(w->block);
+w->capacity = 0;
+if (posix_memalign(&w->block, WS_ALIGN, WS_NDBL * ndbl + WS_NFLT * nflt)) {
+  w->block = NULL;
+  return 1;
+}
+p = (char *) w->block;
+for (k = 0; k < WS_NDBL; k++, p += ndbl) *dbl[k] = (double *) p;
+for (k = 0; k < WS_NFLT; k++, p += nflt) *flt[k] = (float *) p;
+// Stokes parameter V is not present in the tables, i.e. it is always zero
+memset(w->var, 0, ndbl);
+w->capacity = ne;
+return 0;
+}
+
+/*******************************************************************************
+* Diagnostic output
+*
+* The final spectra of the polarised evaluations may be written into the file 
+* stokes.dat (energy, I, Q, U and V devided by energy, polarisation degree, 
+* polarisation angle and "Stokes" angle). It is switched off by default and it 
+* is set by "xset STOKESDISC_DUMP <mode>", where mode is
+*   0 (or not set) - no output,
+*   N > 0          - the file is rewritten at every N-th polarised evaluation,
+*   last           - the file is written only once, for the last polarised 
+*                    evaluation, when XSPEC exits.
+* The whole file is formatted in memory and written at once. Every evaluation
+* context writes its own file, the default one is stokes.dat.
+*******************************************************************************/
+
+#define DUMP_FILE "stokes.dat"
+#define DUMP_NCOL 8
+#define DUMP_LINE (DUMP_NCOL * 16)
+
+typedef struct stokes_dump {
+  int    ne;              // number of rows stored (0 - nothing to write)
+  int    capacity;        // number of rows the buffers have room for
+  long   ncalls;          // number of polarised evaluations so far
+  int    at_exit;         // 1 if the output at exit has been registered
+  long   every;           // current mode (0 - last, N > 0 - every N-th) 
+  double *data;           // stored rows, data[DUMP_NCOL*ne]
+  char   *text;           // formatted file, text[DUMP_LINE*ne+1]
+  char   file[PATH_LEN];  // output file ("" - DUMP_FILE)
+  struct stokes_dump *next; // next output to be written at exit
+} stokes_dump;
+
+static stokes_dump      *dump_exit_list = NULL;
+static int              dump_exit_registered = 0;
+static pthread_mutex_t  dump_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// writes the stored rows into the file
+static void dump_write(stokes_dump *dump) {
+const char *file = strlen(dump->file) ? dump->file : DUMP_FILE;
+char       errstr[PATH_LEN + 64];
+FILE       *fw;
+double     *d;
+size_t     len = 0;
+int        ie;
+
+if (!dump->ne) return;
+for (ie = 0; ie < dump->ne; ie++) {
+  d = dump->data + DUMP_NCOL * ie;
+  len += snprintf(dump->text + len, DUMP_LINE + 1, 
+                  "%E\t%E\t%E\t%E\t%E\t%E\t%E\t%E\n", 
+                  d[0], d[1], d[2], d[3], d[4], d[5], d[6], d[7]);
+}
+if ((fw = fopen(file, "w")) == NULL) {
+  snprintf(errstr, sizeof(errstr), "stokes: cannot open the file %s", file);
+  stokes_write(errstr, 5);
+  return;
+}
+fwrite(dump->text, 1, len, fw);
+fclose(fw);
+}
+
+// writes the outputs registered to be written at exit
+static void dump_exit(void) {
+stokes_dump *dump;
+
+pthread_mutex_lock(&dump_lock);
+for (dump = dump_exit_list; dump != NULL; dump = dump->next) dump_write(dump);
+pthread_mutex_unlock(&dump_lock);
+}
+
+// writes the output registered to be written at exit now and releases the 
+// memory of the output
+static void dump_free(stokes_dump *dump) {
+stokes_dump **d;
+
+if (dump->at_exit) {
+  pthread_mutex_lock(&dump_lock);
+  for (d = &dump_exit_list; *d != NULL; d = &(*d)->next)
+    if (*d == dump) {
+      *d = dump->next;
+      break;
+    }
+  pthread_mutex_unlock(&dump_lock);
+  dump_write(dump);
+  dump->at_exit = 0;
+}
+free(dump->data);
+free(dump->text);
+dump->data = NULL;
+dump->text = NULL;
+dump->ne = dump->capacity = 0;
+}
+
+// counts the polarised evaluations and returns 1 if this one should be stored
+// according to the STOKESDISC_DUMP mode, 0 otherwise
+static int dump_due(stokes_dump *dump) {
+const char *mode = settings[SET_DUMP];
+
+dump->every = strcmp(mode, "last") ? atol(mode) : 0;
+if (dump->every <= 0 && strcmp(mode, "last")) return 0;
+dump->ncalls++;
+return dump->every == 0 || !(dump->ncalls % dump->every);
+}
+
+// stores the spectra of this evaluation and writes them according to the 
+// STOKESDISC_DUMP mode
+static void dump_stokes(stokes_dump *dump, const double *ear, int ne, 
+                        const double *far, const double *qar, 
+                        const double *uar, const double *var, 
+                        const double *pd, const double *pa, 
+                        const double *pa2) {
+double      *d, de;
+int         ie;
+
+if (ne > dump->capacity) {
+  free(dump->data);
+  free(dump->text);
+  dump->data = (double *) malloc(DUMP_NCOL * ne * sizeof(double));
+  dump->text = (char *) malloc(DUMP_LINE * ne + 1);
+  dump->ne = dump->capacity = 0;
+  if (dump->data == NULL || dump->text == NULL) {
+    stokes_write("stokes: not enough memory for the " DUMP_FILE " output", 5);
+    return;
+  }
+  dump->capacity = ne;
+}
+for (ie = 0; ie < ne; ie++) {
+  d = dump->data + DUMP_NCOL * ie;
+  de = ear[ie + 1] - ear[ie];
+  d[0] = 0.5 * (ear[ie] + ear[ie + 1]);
+  d[1] = far[ie] / de;
+  d[2] = qar[ie] / de;
+  d[3] = uar[ie] / de;
+  d[4] = var[ie] / de;
+  d[5] = pd[ie];
+  d[6] = pa[ie];
+  d[7] = pa2[ie];
+}
+dump->ne = ne;
+if (dump->every > 0) dump_write(dump);
+else if (!dump->at_exit) {
+  pthread_mutex_lock(&dump_lock);
+  if (!dump_exit_registered) dump_exit_registered = !atexit(dump_exit);
+  if (dump_exit_registered) {
+    dump->next = dump_exit_list;
+    dump_exit_list = dump;
+    dump->at_exit = 1;
+  }
+  pthread_mutex_unlock(&dump_lock);
+}
+}
+
+/*******************************************************************************
+* Instrumentation
+*
+* "xset STOKESDISC_STATS on" switches on the counting of the evaluations and 
+* the timing of their phases, the results are published after every 
+* evaluation with FPMSTR (like inc_degrees) and may be seen by xset:
+*   stats_calls        - number of evaluations (parameter vectors),
+*   stats_cache_hits   - evaluations with all needed components cached,
+*   stats_cache_misses - evaluations that interpolated the tables,
+*   stats_max_ne       - the largest number of energy bins,
+*   stats_server_local - evaluations made in the process although a server
+*                        is set by STOKESDISC_SERVER (see Section Evaluation
+*                        server),
+*   stats_setup_ns     - time of the paths, tables, workspace and cache setup,
+*   stats_interp_ns    - time of the interpolation of the tables,
+*   stats_output_ns    - time of the computation of the output,
+*   stats_dump_ns      - time of the STOKESDISC_DUMP output,
+* all times are cumulative in nanoseconds. The counters start from zero when
+* the instrumentation is switched on, when it is off (default) only the 
+* setting is read once per call.
+*******************************************************************************/
+
+#define STATS_SETUP  0
+#define STATS_INTERP 1
+#define STATS_OUTPUT 2
+#define STATS_DUMP   3
+#define STATS_NPHASE 4
+
+typedef struct {
+  int       on;                 // 1 if the instrumentation is on
+  long      calls;              // number of evaluations
+  long      hits, misses;       // cache hits and misses
+  int       max_ne;             // the largest number of energy bins
+  long      server_local;       // evaluations not made by the server set
+  long long ns[STATS_NPHASE];   // cumulative time of the phases
+  long long t;                  // end of the last timed phase
+} stokes_stats;
+
+static long long stats_clock(void) {
+struct timespec ts;
+
+clock_gettime(CLOCK_MONOTONIC, &ts);
+return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// reads the STOKESDISC_STATS setting at the start of a call and starts the
+// timing if the instrumentation is on
+static void stats_begin(stokes_stats *st) {
+const char *mode = settings[SET_STATS];
+int        on;
+
+on = !strcmp(mode, "on") || !strcmp(mode, "ON") || !strcmp(mode, "1");
+if (on && !st->on) memset(st, 0, sizeof(stokes_stats));
+st->on = on;
+if (on) st->t = stats_clock();
+}
+
+// adds the time since the end of the last timed phase to the phase
+static void stats_lap(stokes_stats *st, int phase) {
+long long t = stats_clock();
+
+st->ns[phase] += t - st->t;
+st->t = t;
+}
+
+// publishes the counters with FPMSTR
+static void stats_publish(const stokes_stats *st) {
+static char pnames[STATS_NPHASE][128] = {"stats_setup_ns", "stats_interp_ns",
+                                         "stats_output_ns", "stats_dump_ns"};
+static char pcalls[128] = "stats_calls", phits[128] = "stats_cache_hits",
+            pmisses[128] = "stats_cache_misses", pmaxne[128] = "stats_max_ne",
+            plocal[128] = "stats_server_local";
+char        value[32];
+int         k;
+
+sprintf(value, "%ld", st->calls);
+FPMSTR(pcalls, value);
+sprintf(value, "%ld", st->hits);
+FPMSTR(phits, value);
+sprintf(value, "%ld", st->misses);
+FPMSTR(pmisses, value);
+sprintf(value, "%d", st->max_ne);
+FPMSTR(pmaxne, value);
+sprintf(value, "%ld", st->server_local);
+FPMSTR(plocal, value);
+for (k = 0; k < STATS_NPHASE; k++) {
+  sprintf(value, "%lld", st->ns[k]);
+  FPMSTR(pnames[k], value);
+}
+}
+
+/*******************************************************************************
+* Polarisation kernel
+*
+* The output Stokes parameters are linear in the nine table components, the 
+* mixing of the tables for the primary polarisation degree and angle and the 
+* rotation by the position angle are therefore composed once per call into 
+* one coefficient matrix (Mueller-like, rows I, Q, U, columns the components)
+* and the per-bin work is only a few multiply-adds. The matrix, the 
+* polarisation degree and the selection of the output are applied in one pass
+* over the energy bins. The pass works on separate arrays (structure of 
+* arrays) without dependencies between the bins and without branches, the 
+* output is selected by coefficients set once per call, so that the compiler 
+* can vectorise it. Only the unwrapping of the polarisation angles, which is 
+* sequential, is a separate step done when the angles are needed.
+*******************************************************************************/
+
+// composes the mixing of the UNPOL, HRPOL-UNPOL and 45DEG-UNPOL components 
+// for the primary polarisation and the rotation by the position angle:
+//   I = w0*I_0 + w1*I_1 + w2*I_2, 
+//   Q = cos(2*pos_ang)*Q' - sin(2*pos_ang)*U',
+//   U = sin(2*pos_ang)*Q' + cos(2*pos_ang)*U',
+// where X' = w0*X_0 + w1*X_1 + w2*X_2 and 
+//   w = (1, -pol_deg*cos(2*chi), pol_deg*sin(2*chi))
+static void stokes_compose(const double wi[3], const double wqu[3], 
+                           double cos2pa, double sin2pa, double m[3][NCOMP]) {
+int i;
+
+for (i = 0; i < 3; i++) {
+  m[0][i * 3] = wi[i];
+  m[0][i * 3 + 1] = m[0][i * 3 + 2] = 0.;
+  m[1][i * 3] = m[2][i * 3] = 0.;
+  m[1][i * 3 + 1] = cos2pa * wqu[i];
+  m[1][i * 3 + 2] = -sin2pa * wqu[i];
+  m[2][i * 3 + 1] = sin2pa * wqu[i];
+  m[2][i * 3 + 2] = cos2pa * wqu[i];
+}
+}
+
+static void stokes_transform(double pol_deg, double chi, double pos_ang,
+                             double m[3][NCOMP]) {
+double w[3];
+
+w[0] = 1.;
+w[1] = -pol_deg * cos(2. * chi);
+w[2] = pol_deg * sin(2. * chi);
+stokes_compose(w, w, cos(2 * pos_ang), sin(2 * pos_ang), m);
+}
+
+// derivatives of the coefficient matrix with respect to pol_deg, chi and 
+// pos_ang, the angles in degrees
+static void stokes_transform_deriv(double pol_deg, double chi, double pos_ang,
+                                   double dm[3][3][NCOMP]) {
+const double deg = PI / 180., zero[3] = {0., 0., 0.};
+double       w[3], dw[3], cos2pa = cos(2 * pos_ang), sin2pa = sin(2 * pos_ang);
+
+w[0] = 1.;
+w[1] = -pol_deg * cos(2. * chi);
+w[2] = pol_deg * sin(2. * chi);
+// pol_deg
+dw[0] = 0.;
+dw[1] = -cos(2. * chi);
+dw[2] = sin(2. * chi);
+stokes_compose(dw, dw, cos2pa, sin2pa, dm[0]);
+// chi
+dw[1] = 2. * deg * pol_deg * sin(2. * chi);
+dw[2] = 2. * deg * pol_deg * cos(2. * chi);
+stokes_compose(dw, dw, cos2pa, sin2pa, dm[1]);
+// pos_ang, only the rotation of Q and U changes
+stokes_compose(zero, w, -2. * deg * sin2pa, 2. * deg * cos2pa, dm[2]);
+}
+
+// computes I, rotated Q and U and the polarisation degree, and the output for
+// all modes but 6 and 7 (the polarisation angles) into photar
+static void stokes_kernel(int ne, const double *restrict ear, 
+                          const double *restrict smatrix, 
+                          const double m[3][NCOMP], int stokes,
+                          double *restrict far, double *restrict qar_final, 
+                          double *restrict uar_final, double *restrict pd,
+                          double *restrict photar) {
+const double *restrict S0 = smatrix,          *restrict S1 = smatrix + ne,
+             *restrict S2 = smatrix + 2 * ne, *restrict S3 = smatrix + 3 * ne,
+             *restrict S4 = smatrix + 4 * ne, *restrict S5 = smatrix + 5 * ne,
+             *restrict S6 = smatrix + 6 * ne, *restrict S7 = smatrix + 7 * ne,
+             *restrict S8 = smatrix + 8 * ne;
+const double i0 = m[0][0], i3 = m[0][3], i6 = m[0][6],
+             q1 = m[1][1], q2 = m[1][2], q4 = m[1][4], q5 = m[1][5], 
+             q7 = m[1][7], q8 = m[1][8],
+             u1 = m[2][1], u2 = m[2][2], u4 = m[2][4], u5 = m[2][5], 
+             u7 = m[2][7], u8 = m[2][8];
+double cf = 0., cq = 0., cu = 0., cp = 0.;
+int    ratio, ie;
+
+// output = (cf*I + cq*Q + cu*U + cp*pd*dE) [/ I * dE], V is zero
+if (stokes == 1) cf = 1.;
+if (stokes == 2 || stokes == 8) cq = 1.;
+if (stokes == 3 || stokes == 9) cu = 1.;
+if (stokes == 5) cp = 1.;
+ratio = (stokes == 8 || stokes == 9);
+PARALLEL_FOR
+for (ie = 0; ie < ne; ie++) {
+  double de, out, den, scale;
+
+  far[ie] = i0 * S0[ie] + i3 * S3[ie] + i6 * S6[ie];
+  qar_final[ie] = q1 * S1[ie] + q2 * S2[ie] + q4 * S4[ie] + q5 * S5[ie] 
+                + q7 * S7[ie] + q8 * S8[ie];
+  uar_final[ie] = u1 * S1[ie] + u2 * S2[ie] + u4 * S4[ie] + u5 * S5[ie] 
+                + u7 * S7[ie] + u8 * S8[ie];
+  pd[ie] = sqrt(qar_final[ie] * qar_final[ie] + uar_final[ie] * uar_final[ie])
+           / (far[ie] + 1e-99);
+  de = ear[ie + 1] - ear[ie];
+  out = cf * far[ie] + cq * qar_final[ie] + cu * uar_final[ie] 
+        + cp * pd[ie] * de;
+  den = ratio ? far[ie] + 1e-99 : 1.;
+  scale = ratio ? de : 1.;
+  photar[ie] = out / den * scale;
+}
+}
+
+#ifdef STOKESDISC_OFFLOAD
+#pragma omp declare target
+#endif
+// returns the number of turns of 180 degrees to be added to an angle 
+// differing by d from the unwrapped angle of the bin above, so that the 
+// difference ends up within -90 ... 90 degrees, as by subtracting 180 degrees
+// while it is above 90 and adding 180 degrees while it is below -90
+static inline double unwrap_turns(double d) {
+return fmax(0., ceil((-90. - d) / 180.)) - fmax(0., ceil((d - 90.) / 180.));
+}
+
+// adds n turns of 180 degrees in the direction dir (+-1) to the angle a with 
+// the rounding of n separate additions: the additions towards zero and those
+// staying within the binade of a are exact, so they are made at once and only
+// the additions into a larger binade are made one by one
+static double unwrap_steps(double a, double n, double dir) {
+double m, top;
+int    e;
+
+while (n > 0.) {
+  if (a * dir < 0.) {
+    m = floor(fabs(a) / 180.);
+    while (180. * m > fabs(a)) m--;
+  } else {
+    frexp(a, &e);
+    top = ldexp(1., e);
+    m = floor((top - fabs(a)) / 180.);
+    while (fabs(a) + 180. * m > top) m--;
+  }
+  m = m < n ? m : n;
+  a += dir * (180. * m);
+  n -= m;
+  if (n > 0.) {
+    a += dir * 180.;
+    n--;
+  }
+}
+return a;
+}
+
+// unwraps the angles a[] (in degrees) from the highest energy down so that the
+// neighbouring bins differ by at most 90 degrees and shifts them by 180 
+// degrees if the whole range lies too far from zero, with the result of the 
+// original loops (subtracting or adding 180 degrees while the angle differs by
+// more than 90 degrees from the unwrapped angle of the bin above): all the 
+// turns but the last two follow from unwrap_turns() and are added by 
+// unwrap_steps(), the last ones by the loops, so the loops cannot spin on 
+// noisy angles
+static void angle_unwrap(int ne, double *a) {
+double pamin = 1e30, pamax = -1e30, k;
+int    ie;
+
+for (ie = ne - 1; ie >= 0; ie--) {
+  if (ie < ne - 1) {
+    k = unwrap_turns(a[ie] - a[ie + 1]);
+    if (fabs(k) > 2.) 
+      a[ie] = unwrap_steps(a[ie], fabs(k) - 2., k > 0. ? 1. : -1.);
+    while ((a[ie] - a[ie + 1]) > 90.) a[ie] -= 180.;
+    while ((a[ie + 1] - a[ie]) > 90.) a[ie] += 180.;
+  }
+  if (a[ie] < pamin) pamin = a[ie];
+  if (a[ie] > pamax) pamax = a[ie];
+}
+for (ie = 0; ie < ne; ie++) {
+  if ((pamax + pamin) > 180.) a[ie] -= 180.;
+  if ((pamax + pamin) < -180.) a[ie] += 180.;
+}
+}
+#ifdef STOKESDISC_OFFLOAD
+#pragma omp end declare target
+#endif
+
+// computes the polarisation angle psi = 0.5*atan(U/Q) and the "Stokes" angle 
+// beta = 0.5*asin(V/sqrt(Q*Q+U*U+V*V)) (in degrees), unwrapped by 
+// angle_unwrap(), beta is not computed if pa2 is NULL
+static void stokes_angles(int ne, const double *qar_final, 
+                          const double *uar_final, const double *var, 
+                          double *pa, double *pa2) {
+int ie;
+
+PARALLEL_FOR
+for (ie = 0; ie < ne; ie++) 
+  pa[ie] = 0.5 * atan2(uar_final[ie], qar_final[ie]) / PI * 180.;
+angle_unwrap(ne, pa);
+if (pa2 == NULL) return;
+PARALLEL_FOR
+for (ie = 0; ie < ne; ie++) 
+  pa2[ie] = 0.5 * asin(var[ie] / sqrt(qar_final[ie] * qar_final[ie] 
+                       + uar_final[ie] * uar_final[ie] + var[ie] * var[ie] 
+                       + 1e-99)) / PI * 180.;
+angle_unwrap(ne, pa2);
+}
+
+/*******************************************************************************
+* Output kernels
+*
+* Unless the diagnostic output is written, only the output requested by the 
+* Stokes parameter (par8) is computed, by the kernel of that mode chosen once 
+* per call, from the table components needed for it. The modes 2 and 3 (Q or
+* U) need only the Q or U components (if the system is not rotated), the 
+* polarisation degree and angles are computed only in modes 5 and 6, and the 
+* modes 4, 7 and 10 are zero, as Stokes parameter V is zero for these tables.
+*******************************************************************************/
+
+#define COMP_I 0x049   // I components of UNPOL, HRPOL-UNPOL and 45DEG-UNPOL
+#define COMP_Q 0x092   // Q components
+#define COMP_U 0x124   // U components
+#define NMODE  11      // output modes 0 - 10
+
+typedef void (*output_kernel)(int ne, const double *restrict ear, 
+                              const double *restrict smatrix, 
+                              const double m[3][NCOMP], int rotated, 
+                              workspace *w, double *restrict photar);
+
+// returns 1 if par8 is one of the output modes -1 - 10 (after truncation)
+static int stokes_mode_valid(double par8) {
+return par8 > -2. && par8 < NMODE;
+}
+
+// returns the bits of the table components needed for the output of the 
+// given mode, of the system rotated on the sky or not
+static int output_components(int stokes, int rotated, int dumped) {
+static const int need[NMODE] = {0x001, COMP_I, COMP_Q, COMP_U, 0, 
+                                COMP_I | COMP_Q | COMP_U, COMP_Q | COMP_U, 0,
+                                COMP_I | COMP_Q, COMP_I | COMP_U, 0};
+int mask;
+
+if (dumped) return COMP_I | COMP_Q | COMP_U;
+mask = need[stokes];
+if (stokes && rotated && (mask & (COMP_Q | COMP_U))) mask |= COMP_Q | COMP_U;
+return mask;
+}
+
+// computes I
+static void stokes_row_i(int ne, const double *restrict smatrix, 
+                         const double m[3][NCOMP], double *restrict out) {
+const double *restrict S0 = smatrix, *restrict S3 = smatrix + 3 * ne,
+             *restrict S6 = smatrix + 6 * ne;
+const double i0 = m[0][0], i3 = m[0][3], i6 = m[0][6];
+int ie;
+
+PARALLEL_FOR
+for (ie = 0; ie < ne; ie++) out[ie] = i0 * S0[ie] + i3 * S3[ie] + i6 * S6[ie];
+}
+
+// computes the rotated Q (row = 1) or U (row = 2), of the not rotated system 
+// only from the Q or U components
+static void stokes_row_qu(int ne, const double *restrict smatrix, 
+                          const double m[3][NCOMP], int row, int rotated, 
+                          double *restrict out) {
+const double *restrict S1 = smatrix + ne,     *restrict S2 = smatrix + 2 * ne,
+             *restrict S4 = smatrix + 4 * ne, *restrict S5 = smatrix + 5 * ne,
+             *restrict S7 = smatrix + 7 * ne, *restrict S8 = smatrix + 8 * ne;
+const double *restrict A0 = smatrix + row * ne, *restrict A3 = A0 + 3 * ne,
+             *restrict A6 = A0 + 6 * ne;
+const double m1 = m[row][1], m2 = m[row][2], m4 = m[row][4], m5 = m[row][5], 
+             m7 = m[row][7], m8 = m[row][8],
+             a0 = m[row][row], a3 = m[row][row + 3], a6 = m[row][row + 6];
+int ie;
+
+if (rotated) {
+  PARALLEL_FOR
+  for (ie = 0; ie < ne; ie++) 
+    out[ie] = m1 * S1[ie] + m2 * S2[ie] + m4 * S4[ie] + m5 * S5[ie] 
+            + m7 * S7[ie] + m8 * S8[ie];
+} else {
+  PARALLEL_FOR
+  for (ie = 0; ie < ne; ie++) 
+    out[ie] = a0 * A0[ie] + a3 * A3[ie] + a6 * A6[ie];
+}
+}
+
+// modes 4, 7 and 10 - V, "Stokes" angle and V/I, i.e. zero
+static void output_zero(int ne, const double *restrict ear, 
+                        const double *restrict smatrix, 
+                        const double m[3][NCOMP], int rotated, workspace *w, 
+                        double *restrict photar) {
+memset(photar, 0, ne * sizeof(double));
+}
+
+// mode 1 - I
+static void output_i(int ne, const double *restrict ear, 
+                     const double *restrict smatrix, const double m[3][NCOMP], 
+                     int rotated, workspace *w, double *restrict photar) {
+stokes_row_i(ne, smatrix, m, photar);
+}
+
+// mode 2 - Q
+static void output_q(int ne, const double *restrict ear, 
+                     const double *restrict smatrix, const double m[3][NCOMP], 
+                     int rotated, workspace *w, double *restrict photar) {
+stokes_row_qu(ne, smatrix, m, 1, rotated, photar);
+}
+
+// mode 3 - U
+static void output_u(int ne, const double *restrict ear, 
+                     const double *restrict smatrix, const double m[3][NCOMP], 
+                     int rotated, workspace *w, double *restrict photar) {
+stokes_row_qu(ne, smatrix, m, 2, rotated, photar);
+}
+
+// mode 5 - polarisation degree
+static void output_pd(int ne, const double *restrict ear, 
+                      const double *restrict smatrix, const double m[3][NCOMP], 
+                      int rotated, workspace *w, double *restrict photar) {
+const double *restrict far = w->far, *restrict qar = w->qar_final,
+             *restrict uar = w->uar_final;
+int ie;
+
+stokes_row_i(ne, smatrix, m, w->far);
+stokes_row_qu(ne, smatrix, m, 1, rotated, w->qar_final);
+stokes_row_qu(ne, smatrix, m, 2, rotated, w->uar_final);
+PARALLEL_FOR
+for (ie = 0; ie < ne; ie++) 
+  photar[ie] = sqrt(qar[ie] * qar[ie] + uar[ie] * uar[ie]) / (far[ie] + 1e-99)
+               * (ear[ie + 1] - ear[ie]);
+}
+
+// mode 6 - polarisation angle
+static void output_pa(int ne, const double *restrict ear, 
+                      const double *restrict smatrix, const double m[3][NCOMP], 
+                      int rotated, workspace *w, double *restrict photar) {
+int ie;
+
+stokes_row_qu(ne, smatrix, m, 1, rotated, w->qar_final);
+stokes_row_qu(ne, smatrix, m, 2, rotated, w->uar_final);
+stokes_angles(ne, w->qar_final, w->uar_final, NULL, w->pa, NULL);
+PARALLEL_FOR
+for (ie = 0; ie < ne; ie++) photar[ie] = w->pa[ie] * (ear[ie + 1] - ear[ie]);
+}
+
+// modes 8 and 9 - Q/I and U/I
+static void output_qu_i(int ne, const double *restrict ear, 
+                        const double *restrict smatrix, 
+                        const double m[3][NCOMP], int row, int rotated, 
+                        workspace *w, double *restrict photar) {
+const double *restrict far = w->far;
+int ie;
+
+stokes_row_i(ne, smatrix, m, w->far);
+stokes_row_qu(ne, smatrix, m, row, rotated, photar);
+PARALLEL_FOR
+for (ie = 0; ie < ne; ie++) 
+  photar[ie] = photar[ie] / (far[ie] + 1e-99) * (ear[ie + 1] - ear[ie]);
+}
+
+static void output_qi(int ne, const double *restrict ear, 
+                      const double *restrict smatrix, const double m[3][NCOMP], 
+                      int rotated, workspace *w, double *restrict photar) {
+output_qu_i(ne, ear, smatrix, m, 1, rotated, w, photar);
+}
+
+static void output_ui(int ne, const double *restrict ear, 
+                      const double *restrict smatrix, const double m[3][NCOMP], 
+                      int rotated, workspace *w, double *restrict photar) {
+output_qu_i(ne, ear, smatrix, m, 2, rotated, w, photar);
+}
+
+static const output_kernel output_kernels[NMODE] = {NULL, output_i, 
+  output_q, output_u, output_zero, output_pd, output_pa, output_zero, 
+  output_qi, output_ui, output_zero};
+
+/*******************************************************************************
+* Rotation on the sky
+*
+* The position angle pos_ang only rotates Q and U, the polarisation degree 
+* does not depend on it and the polarisation angle is only shifted by it. The 
+* not rotated I, Q and U of the last evaluation (and the polarisation degree 
+* and angle computed from them) are therefore kept, and when only pos_ang 
+* changes (e.g. in scans of the orientation of the system on the sky) the 
+* output of the modes 2, 3, 5, 6, 8 and 9 is computed from them by the 
+* rotation, or by the shift of the angle, alone. The angle of the bins with 
+* Q = U = 0 (e.g. the bins above the tables shifted by zshift) is not shifted
+* by the rotation, and the branch of the angle is decided by the rounding 
+* where the rotated Q < 0 and U = 0, where the neighbouring angles are 90 
+* degrees apart or where the range of the angle is centred at +-90 degrees 
+* (e.g. for chi = 0 or +-90), so the angle of such spectra is computed from 
+* the rotated Q and U as before. The arrays are kept for one cache slot, 
+* pol_deg and chi and they are recomputed when any of them changes.
+* Every evaluation context has its own arrays.
+*******************************************************************************/
+
+#define ROT_I  0x1   // far is valid
+#define ROT_PD 0x2   // pd is valid
+#define ROT_PA 0x4   // pa, pamin and pamax are valid
+#define ROT_EPS 1e-9 // angles (in degrees) closer than it are ambiguous
+
+typedef struct {
+  int                 capacity;   // number of energy bins of the arrays
+  double             *block;      // memory of the arrays
+  double             *far, *qar, *uar, *pd, *pa; // not rotated I, Q, U, 
+                                  // polarisation degree and angle
+  const smatrix_slot *slot;       // slot of the arrays (NULL - none)
+  unsigned long       stored;     // time the key of the slot was stored
+  double              pol_deg, chi;
+  double              pamin, pamax; // range of the unwrapped angle pa
+  int                 ambiguous;  // some bin has Q = U = 0 or the angles of 
+                                  // some neighbouring bins are 90 degrees 
+                                  // apart (with ROT_PA)
+  int                 valid;      // bits of the valid arrays besides qar, uar
+} stokes_rotation;
+
+// releases the memory of the arrays
+static void rotation_free(stokes_rotation *r) {
+free(r->block);
+r->block = NULL;
+r->capacity = 0;
+r->slot = NULL;
+}
+
+// prepares the not rotated arrays of the slot needed for the output of the 
+// given mode, returns 0 if the output can be computed by rotation_output(), 
+// 1 if not (the mode does not depend on pos_ang, the components are missing,
+// the angle is ambiguous or there is not enough memory)
+static int rotation_prepare(stokes_rotation *r, const smatrix_slot *slot, 
+                            int ne, double pol_deg, double chi, int stokes) {
+static const int need[NMODE] = {0, 0, 0, 0, 0, ROT_I | ROT_PD, ROT_PA, 0, 
+                                ROT_I, ROT_I, 0};
+double m[3][NCOMP];
+int    ie;
+
+if (stokes < 2 || stokes == 4 || stokes == 7 || stokes == 10) return 1;
+if ((slot->mask & (COMP_Q | COMP_U)) != (COMP_Q | COMP_U)) return 1;
+if ((need[stokes] & ROT_I) && (slot->mask & COMP_I) != COMP_I) return 1;
+stokes_transform(pol_deg, chi, 0., m);
+if (r->slot != slot || r->stored != slot->stored || r->pol_deg != pol_deg ||
+    r->chi != chi) {
+  r->slot = NULL;
+  if (ne > r->capacity) {
+    free(r->block);
+    r->capacity = 0;
+    if ((r->block = (double *) malloc(5 * ne * sizeof(double))) == NULL) 
+      return 1;
+    r->capacity = ne;
+  }
+  r->far = r->block;
+  r->qar = r->far + r->capacity;
+  r->uar = r->qar + r->capacity;
+  r->pd = r->uar + r->capacity;
+  r->pa = r->pd + r->capacity;
+  stokes_row_qu(ne, slot->smatrix, m, 1, 0, r->qar);
+  stokes_row_qu(ne, slot->smatrix, m, 2, 0, r->uar);
+  r->slot = slot;
+  r->stored = slot->stored;
+  r->pol_deg = pol_deg;
+  r->chi = chi;
+  r->valid = 0;
+}
+if ((need[stokes] & ROT_I) && !(r->valid & ROT_I)) {
+  stokes_row_i(ne, slot->smatrix, m, r->far);
+  r->valid |= ROT_I;
+}
+if ((need[stokes] & ROT_PD) && !(r->valid & ROT_PD)) {
+  const double *restrict far = r->far, *restrict qar = r->qar, 
+               *restrict uar = r->uar;
+  double       *restrict pd = r->pd;
+
+  PARALLEL_FOR
+  for (ie = 0; ie < ne; ie++) 
+    pd[ie] = sqrt(qar[ie] * qar[ie] + uar[ie] * uar[ie]) / (far[ie] + 1e-99);
+  r->valid |= ROT_PD;
+}
+if ((need[stokes] & ROT_PA) && !(r->valid & ROT_PA)) {
+  stokes_angles(ne, r->qar, r->uar, NULL, r->pa, NULL);
+  r->pamin = 1e30;
+  r->pamax = -1e30;
+  r->ambiguous = 0;
+  for (ie = 0; ie < ne; ie++) {
+    if (r->pa[ie] < r->pamin) r->pamin = r->pa[ie];
+    if (r->pa[ie] > r->pamax) r->pamax = r->pa[ie];
+    if (r->qar[ie] == 0. && r->uar[ie] == 0.) r->ambiguous = 1;
+    if (ie && fabs(r->pa[ie] - r->pa[ie - 1]) > 90. - ROT_EPS) 
+      r->ambiguous = 1;
+  }
+  r->valid |= ROT_PA;
+}
+return stokes == 6 && r->ambiguous;
+}
+
+// computes the output of the mode stokes of the system rotated by pos_ang 
+// (in degrees) from the arrays prepared by rotation_prepare(), the angle is 
+// shifted so that it is the angle unwrapped by angle_unwrap() from the highest 
+// energy down, returns 0 if the output is computed, 1 if the branch of the 
+// rotated angle is decided by the rounding (the output is left to the kernel)
+static int rotation_output(const stokes_rotation *r, const double *ear, 
+                            int ne, int stokes, double pos_ang, 
+                            double *restrict photar) {
+const double *restrict far = r->far, *restrict qar = r->qar, 
+             *restrict uar = r->uar, *restrict pd = r->pd, 
+             *restrict pa = r->pa;
+double       cos2pa = cos(2 * (pos_ang / 180. * PI)), 
+             sin2pa = sin(2 * (pos_ang / 180. * PI)), cq, cu, top, shift;
+int          ie;
+
+if (stokes == 5) {
+  PARALLEL_FOR
+  for (ie = 0; ie < ne; ie++) photar[ie] = pd[ie] * (ear[ie + 1] - ear[ie]);
+} else if (stokes == 6) {
+  for (ie = 0; ie < ne; ie++) {
+    cq = cos2pa * qar[ie] - sin2pa * uar[ie];
+    cu = sin2pa * qar[ie] + cos2pa * uar[ie];
+    if (cq < 0. && fabs(cu) <= 1e-9 * -cq) return 1;
+  }
+  // the highest energy bin fixes the multiple of 180 degrees of the shift
+  top = 0.5 * atan2(sin2pa * qar[ne - 1] + cos2pa * uar[ne - 1], 
+                    cos2pa * qar[ne - 1] - sin2pa * uar[ne - 1]) / PI * 180.;
+  shift = pos_ang + 180. * floor((top - pa[ne - 1] - pos_ang) / 180. + 0.5);
+  if (fabs(fabs(r->pamax + r->pamin + 2. * shift) - 180.) < ROT_EPS) return 1;
+  if ((r->pamax + r->pamin + 2. * shift) > 180.) shift -= 180.;
+  else if ((r->pamax + r->pamin + 2. * shift) < -180.) shift += 180.;
+  PARALLEL_FOR
+  for (ie = 0; ie < ne; ie++) 
+    photar[ie] = (pa[ie] + shift) * (ear[ie + 1] - ear[ie]);
+} else {
+  // Q = cos(2*pos_ang)*Q' - sin(2*pos_ang)*U', 
+  // U = sin(2*pos_ang)*Q' + cos(2*pos_ang)*U'
+  // the loops of Q (U) and of Q/I (U/I) are separate, without a test per bin
+  cq = (stokes == 2 || stokes == 8) ? cos2pa : sin2pa;
+  cu = (stokes == 2 || stokes == 8) ? -sin2pa : cos2pa;
+  if (stokes == 8 || stokes == 9) {
+    PARALLEL_FOR
+    for (ie = 0; ie < ne; ie++) 
+      photar[ie] = (cq * qar[ie] + cu * uar[ie]) / (far[ie] + 1e-99) 
+                   * (ear[ie + 1] - ear[ie]);
+  } else {
+    PARALLEL_FOR
+    for (ie = 0; ie < ne; ie++) photar[ie] = cq * qar[ie] + cu * uar[ie];
+  }
+}
+return 0;
+}
+
+/*******************************************************************************
+* Parameter derivatives
+*
+* The polarisation parameters pol_deg, chi and pos_ang enter the output only 
+* through the coefficient matrix, the derivatives of I, Q and U with respect 
+* to them are therefore the derivatives of the matrix applied to the same 
+* interpolated components and the derivatives of the output of every mode 
+* follow in closed form, without further evaluations of the model. The 
+* derivatives with respect to chi and pos_ang are per degree, the derivatives 
+* of the polarisation degree and angle are set to zero where Q = U = 0.
+*******************************************************************************/
+
+// derivative of the polarisation degree (mode 5) from I, Q, U and their 
+// derivatives dI, dQ, dU
+static void jacobian_pd(int ne, const double *restrict ear, 
+                        const double *restrict I, const double *restrict Q, 
+                        const double *restrict U, const double *restrict dQ, 
+                        const double *restrict dU, double *restrict dI) {
+int ie;
+
+PARALLEL_FOR
+for (ie = 0; ie < ne; ie++) {
+  double den = I[ie] + 1e-99, p2 = Q[ie] * Q[ie] + U[ie] * U[ie];
+
+  dI[ie] = p2 > 0. ? ((Q[ie] * dQ[ie] + U[ie] * dU[ie]) / sqrt(p2) 
+                      - sqrt(p2) * dI[ie] / den) / den * (ear[ie + 1] - ear[ie])
+                   : 0.;
+}
+}
+
+// derivative of the polarisation angle (mode 6)
+static void jacobian_pa(int ne, const double *restrict ear, 
+                        const double *restrict I, const double *restrict Q, 
+                        const double *restrict U, const double *restrict dQ, 
+                        const double *restrict dU, double *restrict dI) {
+int ie;
+
+PARALLEL_FOR
+for (ie = 0; ie < ne; ie++) {
+  double p2 = Q[ie] * Q[ie] + U[ie] * U[ie];
+
+  dI[ie] = p2 > 0. ? 0.5 * (Q[ie] * dU[ie] - U[ie] * dQ[ie]) / p2 / PI * 180. 
+                     * (ear[ie + 1] - ear[ie]) : 0.;
+}
+}
+
+// derivative of Q/I (mode 8)
+static void jacobian_qi(int ne, const double *restrict ear, 
+                        const double *restrict I, const double *restrict Q, 
+                        const double *restrict U, const double *restrict dQ, 
+                        const double *restrict dU, double *restrict dI) {
+int ie;
+
+PARALLEL_FOR
+for (ie = 0; ie < ne; ie++) {
+  double den = I[ie] + 1e-99;
+
+  dI[ie] = (dQ[ie] - Q[ie] * dI[ie] / den) / den * (ear[ie + 1] - ear[ie]);
+}
+}
+
+// derivative of U/I (mode 9)
+static void jacobian_ui(int ne, const double *restrict ear, 
+                        const double *restrict I, const double *restrict Q, 
+                        const double *restrict U, const double *restrict dQ, 
+                        const double *restrict dU, double *restrict dI) {
+int ie;
+
+PARALLEL_FOR
+for (ie = 0; ie < ne; ie++) {
+  double den = I[ie] + 1e-99;
+
+  dI[ie] = (dU[ie] - U[ie] * dI[ie] / den) / den * (ear[ie + 1] - ear[ie]);
+}
+}
+
+typedef void (*jacobian_kernel)(int ne, const double *restrict ear, 
+                                const double *restrict I, 
+                                const double *restrict Q, 
+                                const double *restrict U, 
+                                const double *restrict dQ, 
+                                const double *restrict dU, 
+                                double *restrict dI);
+
+static const jacobian_kernel jacobian_kernels[NMODE] = {NULL, NULL, NULL, 
+  NULL, NULL, jacobian_pd, jacobian_pa, NULL, jacobian_qi, jacobian_ui, NULL};
+
+// computes the derivatives of the output of the mode stokes with respect to 
+// pol_deg, chi and pos_ang into dphotar[3][ne], the derivatives of I, Q and U
+// are the rows of the derivative of the matrix, the other modes are computed
+// by the kernel of the mode chosen once per call
+static void stokes_jacobian(int ne, const double *restrict ear, 
+                            const double *restrict smatrix, 
+                            const double m[3][NCOMP], 
+                            const double dm[3][3][NCOMP], int stokes, 
+                            workspace *w, double *restrict dphotar) {
+jacobian_kernel kernel = jacobian_kernels[stokes];
+double          *restrict dI;
+int             k;
+
+for (k = 0; k < 3; k++) {
+  dI = dphotar + k * ne;
+  if (stokes == 1) stokes_row_i(ne, smatrix, dm[k], dI);
+  else if (stokes == 2 || stokes == 3) 
+    stokes_row_qu(ne, smatrix, dm[k], stokes - 1, 1, dI);
+  else if (kernel == NULL) memset(dI, 0, ne * sizeof(double));
+  else {
+    if (k == 0) {
+      stokes_row_i(ne, smatrix, m, w->far);
+      stokes_row_qu(ne, smatrix, m, 1, 1, w->qar_final);
+      stokes_row_qu(ne, smatrix, m, 2, 1, w->uar_final);
+    }
+    stokes_row_i(ne, smatrix, dm[k], dI);
+    stokes_row_qu(ne, smatrix, dm[k], 1, 1, w->pd);
+    stokes_row_qu(ne, smatrix, dm[k], 2, 1, w->pa2);
+    kernel(ne, ear, w->far, w->qar_final, w->uar_final, w->pd, w->pa2, dI);
+  }
+}
+}
+
+/*******************************************************************************
+* Model evaluation
+*
+* The work common to all parameter vectors evaluated on one energy grid (the
+* table paths, the work arrays, the table engine, the float copy and the hash 
+* of the energy grid) is done once by stokes_setup(), each parameter vector is
+* then evaluated by stokes_evaluate(). stokesnidisc() evaluates one parameter
+* vector, stokesnidisc_batch() evaluates nvec of them on the same energy grid,
+* e.g. for the walkers of an ensemble sampler, in the order of the table grid 
+* cells they fall into, so that the vectors in the same cell follow each other
+* and blend the same table memory while it is in the processor caches (each 
+* vector is still blended on its own, only the vectors with equal parameters
+* share the interpolated tables of the cache). stokesnidisc_grids() evaluates
+* one vector on many energy grids (e.g. time resolved spectra), the tables 
+* blended for the parameters by the first grid are kept in the workspace and 
+* only rebinned onto the other grids.
+*
+* All the state of the evaluations (the table paths, the cache, the workspace 
+* and the diagnostic output) is kept in an evaluation context. stokesnidisc() 
+* and stokesnidisc_batch() use the default context of the process, i.e. they 
+* must not be called concurrently. Concurrent evaluations (e.g. independent 
+* fits in threads of one process) each use their own context created by 
+* stokesnidisc_context_new() with stokesnidisc_ctx() and 
+* stokesnidisc_batch_ctx(), all the contexts share the tables loaded by the 
+* native table engine. The XSPEC routines tabintxflt and FPMSTR are called by
+* one context at a time.
+*******************************************************************************/
+
+typedef struct stokes_context {
+  table_paths   paths;          // paths to the tables
+  long          tables_gen;     // generation of the paths the tables are for
+  const stokes_tables *tables;  // native tables of the cached components
+  smatrix_cache cache;          // cache of the interpolated tables
+  rebin_plans   plans;          // rebinning plans of the native tables
+  workspace     ws;             // work arrays
+  stokes_dump   dump;           // diagnostic output
+  stokes_stats  stats;          // instrumentation
+  stokes_rotation rot;          // not rotated output of the last evaluation
+  double        inc_tot;        // inc_degrees of the last evaluation
+  int           adapt;          // STOKESDISC_ADAPTIVE of the cached components
+} stokes_context;
+
+typedef struct {
+  unsigned long hash;           // hash of the energy grid
+  int           engine;         // ENGINE_NATIVE or ENGINE_XSPEC
+  stokes_tables *tables;        // native tables (NULL - ENGINE_XSPEC)
+  int           adapt;          // the adaptive grid is used
+} stokes_grid;
+
+static stokes_context  context = {{-1, 0, "", 0, {"", "", ""}, {"", "", ""}}, 
+                                  0};
+
+// interpolates the table components selected by the bits of mask for the 
+// parameters par (fl_param for tabintxflt) onto the energy grid ear[ne+1] 
+// (its hash and single precision copy fl_ear) into smatrix[NCOMP][ne] by the 
+// engine of su, returns 1 if there is not enough memory
+static int stokes_components(stokes_context *x, const stokes_grid *su,
+                             const double *ear, float *fl_ear, int ne, 
+                             unsigned long hash, const double *par, 
+                             float *fl_param, int single, int mask, 
+                             double *smatrix) {
+const char* xfltname = "Stokes";
+const char* tabtyp = "add";
+float       xfltvalue;
+int         i, j, ie;
+
+if (su->engine != ENGINE_XSPEC) 
+  return tables_interpolate(su->tables, &x->plans, ear, ne, hash, par, single,
+                            mask, x->ws.spec, &x->ws.spec_key, smatrix);
+pthread_mutex_lock(&xspec_lock);
+for (i = 0; i <= 2; i++)
+  for (j = 0; j <= 2; j++) 
+    if ((mask >> (i*3+j)) & 1) {
+      xfltvalue = (float) j;
+      tabintxflt(fl_ear, ne, fl_param, NPAR, x->paths.refspectra[i], 
+                 &xfltname, &xfltvalue, 1, tabtyp, x->ws.fl_photar, 
+                 x->ws.fl_photer);  
+      for(ie = 0; ie < ne; ie++) 
+        smatrix[(i*3+j) * ne + ie] = x->ws.fl_photar[ie];
+    }
+pthread_mutex_unlock(&xspec_lock);
+return 0;
+}
+
+/*******************************************************************************
+* Adaptive energy resolution
+*
+* On fine energy grids (e.g. of the responses with tens of thousands of bins)
+* many bins fall into one energy bin of the tables, whose content the native 
+* rebinning spreads with a flat density. With "xset STOKESDISC_ADAPTIVE on" 
+* the components of the grids of at least ADAPT_MIN_BINS bins are therefore 
+* interpolated on a coarse grid following the resolution of the tables: every
+* run of bins inside one table bin (shifted by zshift) is one coarse bin, the 
+* bins across the edges of the table bins are coarse bins on their own, i.e. 
+* the coarse grid is as fine as the tables around their edges and lines. The 
+* coarse bins are then spread over their bins with a flat density, so the 
+* flux of every component (and of I, Q, U and V in photar) is conserved in 
+* every coarse bin and the result equals the rebinning of the tables onto the 
+* grid itself up to the rounding. The polarisation degree and angles are 
+* computed from the spread components on the grid itself. If the coarse grid
+* would have more than ne/ADAPT_GAIN bins (the tables are not coarser than the
+* grid) and with the XSPEC table engine, whose table bins are not known, the 
+* components are interpolated on the grid itself.
+*******************************************************************************/
+
+#define ADAPT_MIN_BINS 1024
+#define ADAPT_GAIN     2
+
+// computes the coarse grid of the energy grid ear[ne+1] for the table energy 
+// bins t->energy[] shifted by zfac into the bins idx[0...nc] of ear, returns 
+// nc, or -1 if it would be more than nmax
+static int adapt_grid(const stokes_tables *t, const double *ear, int ne, 
+                      double zfac, int nmax, int *idx) {
+double lo, top;
+int    e = 0, i = 0, j, nc = 0;
+
+idx[0] = 0;
+while (i < ne) {
+  // the top of the table bin of the lower edge of the bin i (of the gaps 
+  // below and above the tables)
+  lo = ear[i] * zfac;
+  while (e < t->nebin && t->energy[e + 1] <= lo) e++;
+  if (e == t->nebin) top = HUGE_VAL;
+  else top = t->energy[e] > lo ? t->energy[e] : t->energy[e + 1];
+  for (j = i + 1; j < ne && ear[j + 1] * zfac <= top; j++);
+  if (++nc > nmax) return -1;
+  idx[nc] = j;
+  i = j;
+}
+return nc;
+}
+
+// spreads the components selected by mask of the coarse bins j0 ... j1-1 of 
+// sc[NCOMP][nc] on the coarse grid idx[] over the bins of the energy grid 
+// ear[] with flat densities, rounded to single precision if single is set
+static void adapt_spread(const double *ear, int ne, const int *idx, int nc,
+                         const double *sc, int single, int mask, int j0, 
+                         int j1, double *smatrix) {
+double d, v;
+int    j, k, ie;
+
+for (k = 0; k < NCOMP; k++) {
+  if (!((mask >> k) & 1)) continue;
+  for (j = j0; j < j1; j++) {
+    if (idx[j + 1] - idx[j] == 1) {
+      v = sc[k * nc + j];
+      smatrix[k * ne + idx[j]] = single ? (float) v : v;
+      continue;
+    }
+    d = ear[idx[j + 1]] > ear[idx[j]] ? 
+        sc[k * nc + j] / (ear[idx[j + 1]] - ear[idx[j]]) : 0.;
+    for (ie = idx[j]; ie < idx[j + 1]; ie++) {
+      v = d * (ear[ie + 1] - ear[ie]);
+      smatrix[k * ne + ie] = single ? (float) v : v;
+    }
+  }
+}
+}
+
+// interpolates the components selected by mask on the coarse grid of the 
+// energy grid ear[ne+1] (rounded to single precision if single is set) and 
+// spreads them into smatrix[NCOMP][ne], returns 1 if there is not enough 
+// memory and -1 if the coarse grid is not used (smatrix is not changed then)
+static int stokes_adaptive(stokes_context *x, const stokes_grid *su,
+                           const double *ear, int ne, const double *par,
+                           float *fl_param, int single, int mask, 
+                           double *smatrix) {
+const stokes_tables *t = su->tables;
+const double        *eu = single ? x->ws.ear_single : ear;
+const int           nmax = ne / ADAPT_GAIN;
+double              *ec, *sc, zfac;
+int                 *idx, nc, j, c, n, status = 1;
+
+if (su->engine == ENGINE_XSPEC) return -1;
+zfac = t->redshift ? 1. + par[t->nintparm] : 1.;
+if ((idx = (int *) malloc((nmax + 1) * sizeof(int))) == NULL) return 1;
+if ((nc = adapt_grid(t, eu, ne, zfac, nmax, idx)) < 0) {
+  free(idx);
+  return -1;
+}
+ec = (double *) malloc((nc + 1) * sizeof(double));
+sc = (double *) malloc(NCOMP * nc * sizeof(double));
+if (ec != NULL && sc != NULL) {
+  for (j = 0; j <= nc; j++) ec[j] = eu[idx[j]];
+  // not rounded until spread
+  status = stokes_components(x, su, ec, NULL, nc, ear_hash(ec, nc), par, 
+                             fl_param, 0, mask, sc);
+}
+if (!status) {
+  n = par_threads;
+  PARALLEL_FOR
+  for (c = 0; c < n; c++) 
+    adapt_spread(eu, ne, idx, nc, sc, single, mask, par_first(nc, c, n), 
+                 par_first(nc, c + 1, n), smatrix);
+}
+free(idx);
+free(ec);
+free(sc);
+return status;
+}
+
+// prepares the evaluation on the energy grid ear, returns 1 on failure (also
+// if the grid has no bins)
+static int stokes_setup(stokes_context *x, const double *ear, int ne, 
+                        stokes_grid *su) {
+const char *table_engine = settings[SET_TABLES];
+const char *storage_mode = settings[SET_STORAGE];
+const char *precision = settings[SET_PRECISION];
+const char *adaptive = settings[SET_ADAPTIVE];
+int        ie, storage, adapt;
+
+// there is nothing to evaluate on an empty grid
+if (ne < 1) return 1;
+stats_begin(&x->stats);
+// - if set try XSDIR directory, otherwise look in the working directory
+if (table_paths_resolve(&x->paths)) return 1;
+
+//Let's read and interpolate the FITS tables that we will need using the
+//native table engine or the internal XSPEC routine tabintxflt, unless they 
+//are already cached for this energy grid and these parameters
+su->engine = ENGINE_NATIVE;
+su->tables = NULL;
+if (!strcmp(table_engine, "xspec") || !strcmp(table_engine, "XSPEC"))
+  su->engine = ENGINE_XSPEC;
+if (su->engine == ENGINE_NATIVE) {
+  storage = STORAGE_FULL;
+  if (!strcmp(storage_mode, "diff") || !strcmp(storage_mode, "DIFF"))
+    storage = STORAGE_DIFF;
+  if (!strcmp(storage_mode, "half") || !strcmp(storage_mode, "HALF"))
+    storage = STORAGE_HALF;
+  su->tables = tables_get(&x->paths, storage, 
+                          x->tables_gen != x->paths.generation);
+  x->tables_gen = x->paths.generation;
+  // the cached components interpolated from other tables are dropped
+  if (su->tables != NULL && su->tables != x->tables) {
+    smatrix_cache_free(&x->cache);
+    x->tables = su->tables;
+  }
+  if (su->tables == NULL) su->engine = ENGINE_XSPEC;
+  else if (!strcmp(precision, "double") || !strcmp(precision, "DOUBLE")) 
+    su->engine = ENGINE_DOUBLE;
+}
+// the cached components interpolated otherwise are dropped
+adapt = !strcmp(adaptive, "on") || !strcmp(adaptive, "ON");
+if (adapt != x->adapt) {
+  smatrix_cache_free(&x->cache);
+  x->adapt = adapt;
+}
+su->adapt = adapt && ne >= ADAPT_MIN_BINS;
+
+if (workspace_reserve(&x->ws, ne, su->tables != NULL ? 
+                      (long) su->tables->nebin * NCOMP : 0)) {
+  stokes_write("stokes: not enough memory for the work arrays", 5);
+  return 1;
+}
+// the double precision engine works directly on ear
+if (su->engine == ENGINE_XSPEC) 
+  for(ie = 0; ie <= ne; ie++) x->ws.fl_ear[ie] = (float) ear[ie];
+if (su->engine == ENGINE_NATIVE) 
+  for(ie = 0; ie <= ne; ie++) x->ws.ear_single[ie] = (float) ear[ie];
+par_threads_set(ne);
+su->hash = ear_hash(ear, ne);
+if (x->stats.on) stats_lap(&x->stats, STATS_SETUP);
+return 0;
+}
+
+// returns the output mode (par8) of the parameter vector for the data set ifl,
+// 0 - 10 (the modes out of range fall back to 0)
+static int stokes_mode(const double *param, int ifl) {
+const char* xfltname = "Stokes";
+float       xfltvalue;
+int         stokes;
+
+// also NaN is out of range, the value is truncated as before
+if (!stokes_mode_valid(param[7])) {
+  stokes_write("stokes: par8 must be between -1 and 10", 5);
+  stokes_write("stokes: stokes = par8 = 0 (i.e. counts) will be used", 5);
+  return 0;
+}
+stokes = (int) param[7];
+if(stokes == -1){
+  pthread_mutex_lock(&xspec_lock);
+  xfltvalue = DGFILT(ifl, xfltname);
+  pthread_mutex_unlock(&xspec_lock);
+  if (xfltvalue == 0. || xfltvalue == 1. || xfltvalue == 2.){
+    stokes = 1 + (int) xfltvalue;
+  }
+  else {
+    stokes_write("stokes: no or wrong information on data type (counts, q, u)",
+                 5);
+    stokes_write("stokes: stokes = par8 = 0 (i.e. counts) will be used", 5);
+    stokes=0;
+  }
+}
+return stokes;
+}
+
+// evaluates the model for one parameter vector, returns 1 on failure
+// (and its derivatives with respect to pol_deg, chi and pos_ang into 
+// dphotar[3][ne] unless dphotar is NULL)
+static int stokes_evaluate(stokes_context *x, const double *ear, int ne, 
+                           const stokes_grid *su, const double *param, 
+                           int ifl, double *photar, double *dphotar) {
+
+static char   pinc_degrees[128] = "inc_degrees";
+int status = 0;
+
+int    i, j, ie, stokes, engine, single, dumped, rotated, mask, missing;
+double pol_deg, chi, pos_ang;
+double (*Smatrix)[ne];
+smatrix_slot  *slot = NULL;
+float  fl_param[NPAR]={(float) param[0], (float) param[1], (float) param[2],(float) param[6]};
+double par[NPAR] = {param[0], param[1], param[2], param[6]};
+double *far, *qar_final, *uar_final, *var, *pd, *pa, *pa2;
+double inc_tot, mueller[3][NCOMP], dmueller[3][3][NCOMP];
+
+char inc_degrees[32];
+
+//Note that only the double precision engine does not round the parameters 
+//to single precision
+engine = su->engine;
+single = (engine != ENGINE_DOUBLE);
+if (single) for (i = 0; i < NPAR; i++) par[i] = fl_param[i];
+pol_deg = param[3];
+chi = param[4]/180.*PI;
+pos_ang = param[5]/180.*PI;
+stokes = stokes_mode(param, ifl);
+inc_tot = acos(par[2]) / PI * 180.0;
+
+far = x->ws.far;
+var = x->ws.var;
+pd = x->ws.pd;
+pa = x->ws.pa;
+pa2 = x->ws.pa2;
+qar_final = x->ws.qar_final;
+uar_final = x->ws.uar_final;
+
+//Note that we do not use errors here
+dumped = stokes ? dump_due(&x->dump) : 0;
+rotated = (sin(2 * pos_ang) != 0.);
+mask = output_components(stokes, rotated, dumped);
+if (dphotar != NULL && stokes) mask |= COMP_I | COMP_Q | COMP_U;
+slot = smatrix_cache_find(&x->cache, ifl, su->hash, ear, ne, par, 
+                          x->paths.generation, engine);
+if (slot == NULL && mask) {
+  if ((slot = smatrix_cache_reserve(&x->cache, ne)) == NULL) {
+    stokes_write("stokes: not enough memory for the interpolated tables", 5);
+    for (ie = 0; ie < ne; ie++) photar[ie] = 0.;
+    return 1;
+  }
+  smatrix_cache_store(&x->cache, slot, ifl, su->hash, ear, ne, par, 
+                      x->paths.generation, engine);
+}
+missing = slot != NULL ? mask & ~slot->mask : 0;
+if (x->stats.on) {
+  x->stats.calls++;
+  if (ne > x->stats.max_ne) x->stats.max_ne = ne;
+  if (missing) x->stats.misses++;
+  else if (mask) x->stats.hits++;
+  stats_lap(&x->stats, STATS_SETUP);
+}
+if (missing) {
+  Smatrix = (double (*)[ne]) slot->smatrix;
+  // The status parameter must always be initialized.
+  status = 0;
+  status = su->adapt ? stokes_adaptive(x, su, ear, ne, par, fl_param, 
+                                       single, missing, slot->smatrix)
+                      : -1;
+  if (status < 0) 
+    status = stokes_components(x, su, single ? x->ws.ear_single : ear, 
+                               x->ws.fl_ear, ne, su->hash, par, fl_param, 
+                               single, missing, slot->smatrix);
+  if (status) {
+    stokes_write("stokes: not enough memory for the rebinning of the tables", 
+                 5);
+    for (ie = 0; ie < ne; ie++) photar[ie] = 0.;
+    return 1;
+  }
+  //HORIZONTALLY POLARISED and 45DEG POLARISED tables are kept with the 
+  //UNPOLARISED ones subtracted
+//        UNPOLARISED i = 0,1,2; HORIZONTALLY POLARISED i = 3,4,5, 45DEG POLARISED i = 6,7,8     
+//the single precision tables are subtracted in single precision, the compact
+//storage of the native tables is subtracted already
+  if (engine == ENGINE_XSPEC || su->tables->storage == STORAGE_FULL) {
+    for(j = 3; j < NCOMP; j++) 
+      if (((missing >> j) & 1) && single) 
+        for(ie = 0; ie < ne; ie++) 
+          Smatrix[j][ie] = (float) Smatrix[j][ie] - (float) Smatrix[j%3][ie];
+      else if ((missing >> j) & 1) 
+        for(ie = 0; ie < ne; ie++) Smatrix[j][ie] -= Smatrix[j%3][ie];
+  }
+  slot->mask |= missing;
+  if (x->stats.on) stats_lap(&x->stats, STATS_INTERP);
+}
+
+x->inc_tot = inc_tot;
+sprintf(inc_degrees, "%12.6f", inc_tot);
+pthread_mutex_lock(&xspec_lock);
+FPMSTR(pinc_degrees, inc_degrees);
+pthread_mutex_unlock(&xspec_lock);
+
+// interface with XSPEC
+if (!stokes) for (ie = 0; ie < ne; ie++) photar[ie] = slot->smatrix[ie];
+else {
+  //Let's perform the transformation to initial primary polarisation degree 
+  //and angle, change the orientation of the system and compute the output
+  stokes_transform(pol_deg, chi, pos_ang, mueller);
+  if (!dumped) {
+    if (slot == NULL || 
+        rotation_prepare(&x->rot, slot, ne, pol_deg, chi, stokes) ||
+        rotation_output(&x->rot, ear, ne, stokes, param[5], photar))
+      output_kernels[stokes](ne, ear, slot != NULL ? slot->smatrix : NULL, 
+                             mueller, rotated, &x->ws, photar);
+  } else {
+    stokes_kernel(ne, ear, slot->smatrix, mueller, stokes, far, qar_final, 
+                  uar_final, pd, photar);
+    stokes_angles(ne, qar_final, uar_final, var, pa, pa2);
+    if (stokes == 6) 
+      for (ie = 0; ie < ne; ie++) photar[ie] = pa[ie] * (ear[ie + 1] - ear[ie]);
+    if (stokes == 7) 
+      for (ie = 0; ie < ne; ie++) photar[ie] = pa2[ie] * (ear[ie + 1] - ear[ie]);
+    if (x->stats.on) stats_lap(&x->stats, STATS_OUTPUT);
+    dump_stokes(&x->dump, ear, ne, far, qar_final, uar_final, var, pd, pa, 
+                pa2);
+    if (x->stats.on) stats_lap(&x->stats, STATS_DUMP);
+  }
+}
+if (dphotar != NULL) {
+  stokes_transform_deriv(pol_deg, chi, pos_ang, dmueller);
+  stokes_jacobian(ne, ear, slot != NULL ? slot->smatrix : NULL, mueller, 
+                  dmueller, stokes, &x->ws, dphotar);
+}
+if (x->stats.on) {
+  if (!dumped) stats_lap(&x->stats, STATS_OUTPUT);
+  pthread_mutex_lock(&xspec_lock);
+  stats_publish(&x->stats);
+  pthread_mutex_unlock(&xspec_lock);
+}
+
+return 0;
+}
+
+#ifdef STOKESDISC_OFFLOAD
+/*******************************************************************************
+* Device offload
+*
+* Compiled with -DSTOKESDISC_OFFLOAD and OpenMP offloading (e.g. with 
+* "-fopenmp -foffload=nvptx-none" for GCC or "-fopenmp 
+* -fopenmp-targets=nvptx64" for Clang), stokesnidisc_batch() evaluates all the 
+* parameter vectors at once on the default OpenMP device (GPU). The native 
+* tables are copied to the device once and kept there, for every batch only 
+* the interpolation weights and corners, the mixing and rotation coefficients 
+* of the vectors and the energy grid are sent to the device and the output of
+* all the vectors and bins is returned. Every pair of a vector and an energy 
+* bin is evaluated by its own device thread with the operations in the same 
+* order as on the host, the polarisation angles (mode 6) are computed from the
+* rotated Q and U of every bin as by the full kernel (not shifted as by 
+* rotation_output()) and then unwrapped by one thread per vector.
+*
+* The offload is used if an OpenMP device is available, "xset 
+* STOKESDISC_OFFLOAD off" switches it off and "xset STOKESDISC_OFFLOAD on" 
+* forces it (without a device on the host fallback of OpenMP). The batches 
+* evaluated with the XSPEC engine or with the diagnostic output, and all 
+* batches if the tables do not fit into the memory of the device, are 
+* evaluated on the host.
+*******************************************************************************/
+
+#define OFFLOAD_NC (1 << NPAR)   // corners of a grid cell
+#define OFFLOAD_NCO 4            // w1, w2, cos(2*pos_ang), sin(2*pos_ang)
+                                 // of each vector
+
+// copies the tables to the default device unless they are there already,
+// returns 0 if the tables are on the device, 1 otherwise
+static int tables_device(stokes_tables *t) {
+int    dev = omp_get_default_device(), host = omp_get_initial_device(), err;
+size_t size, nscale = (size_t) t->ngrid * t->ncomp * sizeof(float);
+
+size = (size_t) t->ngrid * t->nebin * t->ncomp * 
+       (t->storage == STORAGE_HALF ? sizeof(uint16_t) : sizeof(float));
+pthread_mutex_lock(&tables_lock);
+if (t->dev_data == NULL && t->ncomp > 0) {
+  t->dev_data = omp_target_alloc(size, dev);
+  t->dev_energy = omp_target_alloc((t->nebin + 1) * sizeof(double), dev);
+  err = t->dev_data == NULL || t->dev_energy == NULL;
+  if (!err) 
+    err = omp_target_memcpy(t->dev_data, t->storage == STORAGE_HALF ? 
+                            (void *) t->half : (void *) t->data, size, 0, 0, 
+                            dev, host) ||
+          omp_target_memcpy(t->dev_energy, t->energy, 
+                            (t->nebin + 1) * sizeof(double), 0, 0, dev, host);
+  if (!err && t->storage == STORAGE_HALF) {
+    t->dev_scale = omp_target_alloc(nscale, dev);
+    t->dev_half = omp_target_alloc(sizeof(half_values), dev);
+    err = t->dev_scale == NULL || t->dev_half == NULL || 
+          omp_target_memcpy(t->dev_scale, t->scale, nscale, 0, 0, dev, host) ||
+          omp_target_memcpy(t->dev_half, half_values, sizeof(half_values), 
+                            0, 0, dev, host);
+  }
+  if (err) {
+    tables_device_free(t);
+    stokes_write("stokes: the tables do not fit into the device memory", 10);
+  }
+}
+err = t->dev_data == NULL;
+pthread_mutex_unlock(&tables_lock);
+return err;
+}
+
+#pragma omp declare target
+// computes the nine interpolated components S[] of one vector (with the 
+// ncorner corners cg[] and weights cw[] of its grid cell and zfac = 1 + 
+// redshift) in the model energy bin elo ... ehi, as tables_blend(), 
+// tables_rebin() and the subtraction of the UNPOL table in stokes_evaluate()
+static void offload_components(int nebin, int nstored, const int *index, 
+                               int storage, const float *data, 
+                               const uint16_t *half, const float *scale, 
+                               const float *hv, const double *energy, 
+                               int ncorner, const double *cw, const long *cg,
+                               double elo, double ehi, double zfac, 
+                               int single, double *S) {
+double sum[NCOMP], spec, de, overlap, w;
+long   i;
+int    lo = -1, hi = nebin, mid, e, k, c;
+
+for (k = 0; k < NCOMP; k++) sum[k] = 0.;
+elo *= zfac;
+ehi *= zfac;
+// the first table bin ending above the lower energy of the bin
+while (hi - lo > 1) {
+  mid = (lo + hi) / 2;
+  if (energy[mid + 1] <= elo) lo = mid;
+  else hi = mid;
+}
+for (e = hi; e < nebin && energy[e] < ehi; e++) {
+  de = energy[e + 1] - energy[e];
+  overlap = (energy[e + 1] < ehi ? energy[e + 1] : ehi) - 
+            (energy[e] > elo ? energy[e] : elo);
+  if (overlap > 0. && de > 0.) {
+    w = overlap / de;
+    for (k = 0; k < NCOMP; k++) {
+      if (index[k] < 0) continue;
+      spec = 0.;
+      for (c = 0; c < ncorner; c++) {
+        i = (cg[c] * nebin + e) * nstored + index[k];
+        if (storage == STORAGE_HALF) 
+          spec += cw[c] * scale[cg[c] * nstored + index[k]] * hv[half[i]];
+        else spec += cw[c] * data[i];
+      }
+      sum[k] += spec * w;
+    }
+  }
+  if (energy[e + 1] > ehi) break;
+}
+for (k = 0; k < NCOMP; k++) 
+  S[k] = single ? (float) (sum[k] / zfac) : sum[k] / zfac;
+if (storage == STORAGE_FULL) 
+  for (k = 3; k < NCOMP; k++) 
+    S[k] = single ? (float) S[k] - (float) S[k % 3] : S[k] - S[k % 3];
+}
+
+// returns the output of the mode stokes in one bin of the width de from the 
+// components S[] and the coefficients co[OFFLOAD_NCO] of the vector, the 
+// angle of mode 6 is the not unwrapped one of the Q and U rotated as by the 
+// full kernel (stokes_row_qu() with the rotated matrix of stokes_transform())
+static double offload_output(int stokes, const double *S, const double *co, 
+                             double de) {
+double i, q, u;
+
+i = 1. * S[0] + co[0] * S[3] + co[1] * S[6];
+if (stokes == 6) {
+  q = (co[2] * 1.) * S[1] + (-co[3] * 1.) * S[2] + (co[2] * co[0]) * S[4] 
+    + (-co[3] * co[0]) * S[5] + (co[2] * co[1]) * S[7] 
+    + (-co[3] * co[1]) * S[8];
+  u = (co[3] * 1.) * S[1] + (co[2] * 1.) * S[2] + (co[3] * co[0]) * S[4] 
+    + (co[2] * co[0]) * S[5] + (co[3] * co[1]) * S[7] 
+    + (co[2] * co[1]) * S[8];
+  return 0.5 * atan2(u, q) / PI * 180.;
+}
+q = 1. * S[1] + co[0] * S[4] + co[1] * S[7];
+u = 1. * S[2] + co[0] * S[5] + co[1] * S[8];
+switch (stokes) {
+  case 0: return S[0];
+  case 1: return i;
+  case 2: return co[2] * q + (-co[3]) * u;
+  case 3: return co[3] * q + co[2] * u;
+  case 5: return sqrt(q * q + u * u) / (i + 1e-99) * de;
+  case 8: return (co[2] * q + (-co[3]) * u) / (i + 1e-99) * de;
+  case 9: return (co[3] * q + co[2] * u) / (i + 1e-99) * de;
+}
+return 0.;
+}
+
+// unwraps the rotated angles a[ne] of one vector by angle_unwrap() and 
+// multiplies them by the bin widths
+static void offload_angles(int ne, const double *ear, double *a) {
+int ie;
+
+angle_unwrap(ne, a);
+for (ie = 0; ie < ne; ie++) a[ie] *= ear[ie + 1] - ear[ie];
+}
+#pragma omp end declare target
+
+// evaluates the nvec parameter vectors on the device, returns 0 on success, 
+// 1 if the vectors are to be evaluated on the host
+static int stokes_offload(stokes_context *x, const double *ear, int ne, 
+                          const stokes_grid *su, const double *param, 
+                          int nvec, int ifl, double *photar) {
+static char   pinc_degrees[128] = "inc_degrees";
+stokes_tables *t = su->tables;
+const double  *p, *eg = su->engine == ENGINE_DOUBLE ? ear : x->ws.ear_single;
+double        par[NPAR], chi, *cw, *zf, *co;
+long          *cg, n = (long) nvec * ne;
+const char    *mode;
+char          inc_degrees[32];
+int           *nc, *md, single, v, k;
+
+mode = settings[SET_OFFLOAD];
+if (su->engine == ENGINE_XSPEC || !strcmp(mode, "off") || 
+    !strcmp(mode, "OFF")) return 1;
+if (strcmp(mode, "on") && strcmp(mode, "ON") && omp_get_num_devices() < 1) 
+  return 1;
+mode = settings[SET_DUMP];
+if (!strcmp(mode, "last") || atol(mode) > 0 || tables_device(t)) return 1;
+cw = (double *) malloc(nvec * (OFFLOAD_NC + 1 + OFFLOAD_NCO) * 
+                       sizeof(double));
+cg = (long *) malloc(nvec * OFFLOAD_NC * sizeof(long));
+nc = (int *) malloc(2 * nvec * sizeof(int));
+if (cw == NULL || cg == NULL || nc == NULL) {
+  free(cw);
+  free(cg);
+  free(nc);
+  return 1;
+}
+zf = cw + nvec * OFFLOAD_NC;
+co = zf + nvec;
+md = nc + nvec;
+// interpolation weights and coefficients of the vectors, as in 
+// stokes_evaluate() and stokes_transform()
+single = (su->engine != ENGINE_DOUBLE);
+for (v = 0; v < nvec; v++) {
+  p = param + v * 8;
+  par[0] = p[0];
+  par[1] = p[1];
+  par[2] = p[2];
+  par[3] = p[6];
+  if (single) for (k = 0; k < NPAR; k++) par[k] = (float) par[k];
+  nc[v] = tables_corners(t, par, cw + v * OFFLOAD_NC, cg + v * OFFLOAD_NC);
+  zf[v] = t->redshift ? 1. + par[t->nintparm] : 1.;
+  md[v] = stokes_mode(p, ifl);
+  chi = p[4]/180.*PI;
+  co[v * OFFLOAD_NCO] = -p[3] * cos(2. * chi);
+  co[v * OFFLOAD_NCO + 1] = p[3] * sin(2. * chi);
+  co[v * OFFLOAD_NCO + 2] = cos(2 * (p[5] / 180. * PI));
+  co[v * OFFLOAD_NCO + 3] = sin(2 * (p[5] / 180. * PI));
+}
+{
+  const float    *data = (const float *) t->dev_data, 
+                 *scale = (const float *) t->dev_scale, 
+                 *hv = (const float *) t->dev_half;
+  const uint16_t *half = (const uint16_t *) t->dev_data;
+  const double   *energy = (const double *) t->dev_energy;
+  const int      *index = t->index;
+  int            nebin = t->nebin, nstored = t->ncomp, storage = t->storage;
+
+  #pragma omp target data map(to: ear[0:ne + 1], eg[0:ne + 1], \
+    cw[0:nvec * OFFLOAD_NC], cg[0:nvec * OFFLOAD_NC], nc[0:nvec], md[0:nvec], \
+    zf[0:nvec], co[0:nvec * OFFLOAD_NCO], index[0:NCOMP]) \
+    map(from: photar[0:n])
+  {
+    #pragma omp target teams distribute parallel for collapse(2) \
+      is_device_ptr(data, half, scale, hv, energy)
+    for (v = 0; v < nvec; v++) 
+      for (k = 0; k < ne; k++) {
+        double S[NCOMP];
+
+        offload_components(nebin, nstored, index, storage, data, half, scale, 
+                           hv, energy, nc[v], cw + v * OFFLOAD_NC, 
+                           cg + v * OFFLOAD_NC, eg[k], eg[k + 1], zf[v], 
+                           single, S);
+        photar[v * (long) ne + k] = offload_output(md[v], S, 
+                                                   co + v * OFFLOAD_NCO, 
+                                                   ear[k + 1] - ear[k]);
+      }
+    #pragma omp target teams distribute parallel for
+    for (v = 0; v < nvec; v++) 
+      if (md[v] == 6) offload_angles(ne, ear, photar + v * (long) ne);
+  }
+}
+// the xset values of the last vector, as by stokes_evaluate()
+p = param + (nvec - 1) * 8;
+par[2] = single ? (float) p[2] : p[2];
+x->inc_tot = acos(par[2]) / PI * 180.0;
+sprintf(inc_degrees, "%12.6f", x->inc_tot);
+pthread_mutex_lock(&xspec_lock);
+FPMSTR(pinc_degrees, inc_degrees);
+if (x->stats.on) {
+  x->stats.calls += nvec;
+  if (ne > x->stats.max_ne) x->stats.max_ne = ne;
+  stats_lap(&x->stats, STATS_OUTPUT);
+  stats_publish(&x->stats);
+}
+pthread_mutex_unlock(&xspec_lock);
+free(cw);
+free(cg);
+free(nc);
+return 0;
+}
+#endif
+
+// returns a new evaluation context, NULL if there is not enough memory
+stokes_context* stokesnidisc_context_new(void) {
+stokes_context *x;
+
+if ((x = (stokes_context *) calloc(1, sizeof(stokes_context))) == NULL) 
+  return NULL;
+x->paths.state = -1;
+return x;
+}
+
+// releases the evaluation context, its diagnostic output registered to be 
+// written at exit is written now
+void stokesnidisc_context_free(stokes_context *x) {
+if (x == NULL) return;
+dump_free(&x->dump);
+smatrix_cache_free(&x->cache);
+rebin_plans_free(&x->plans);
+workspace_free(&x->ws);
+rotation_free(&x->rot);
+free(x);
+}
+
+// sets the file of the diagnostic output of the context (NULL - stokes.dat),
+// returns 1 if the file name is too long
+int stokesnidisc_context_dump(stokes_context *x, const char *file) {
+if (file != NULL && strlen(file) >= PATH_LEN) return 1;
+snprintf(x->dump.file, PATH_LEN, "%s", file != NULL ? file : "");
+return 0;
+}
+
+// evaluates the model for one parameter vector in the context x
+int stokesnidisc_ctx(stokes_context *x, const double *ear, int ne, 
+                     const double *param, int ifl, double *photar, 
+                     double *photer, const char* init) {
+stokes_grid su;
+int         ie;
+
+settings_read();
+if (stokes_setup(x, ear, ne, &su)) {
+  for (ie = 0; ie < ne; ie++) photar[ie] = 0.;
+  return 1;
+}
+return stokes_evaluate(x, ear, ne, &su, param, ifl, photar, NULL);
+}
+
+// evaluates the model for one parameter vector in the context x together with
+// its derivatives with respect to pol_deg (dphotar[0...ne-1]), chi 
+// (dphotar[ne...2*ne-1]) and pos_ang (dphotar[2*ne...3*ne-1]), the 
+// derivatives with respect to the angles are per degree
+int stokesnidisc_deriv_ctx(stokes_context *x, const double *ear, int ne, 
+                           const double *param, int ifl, double *photar, 
+                           double *dphotar, const char* init) {
+stokes_grid su;
+int         ie;
+
+settings_read();
+if (stokes_setup(x, ear, ne, &su)) {
+  for (ie = 0; ie < ne; ie++) photar[ie] = 0.;
+  for (ie = 0; ie < 3 * ne; ie++) dphotar[ie] = 0.;
+  return 1;
+}
+if (stokes_evaluate(x, ear, ne, &su, param, ifl, photar, dphotar)) {
+  for (ie = 0; ie < 3 * ne; ie++) dphotar[ie] = 0.;
+  return 1;
+}
+return 0;
+}
+
+// grid cell of the native tables of a vector of a batch
+typedef struct {
+  long cell;
+  int  index;          // index of the vector in the batch
+} batch_cell;
+
+// orders the vectors by their cells, the vectors of one cell in the order of 
+// the batch
+static int batch_cell_compare(const void *a, const void *b) {
+const batch_cell *x = (const batch_cell *) a, *y = (const batch_cell *) b;
+
+if (x->cell != y->cell) return x->cell < y->cell ? -1 : 1;
+return (x->index > y->index) - (x->index < y->index);
+}
+
+// evaluates nvec parameter vectors param[nvec][8] on the same energy grid ear
+// in the context x, the output of the vector k is stored in 
+// photar[k*ne...(k+1)*ne-1], returns 1 if any of the evaluations failed (its 
+// output is zero)
+int stokesnidisc_batch_ctx(stokes_context *x, const double *ear, int ne, 
+                           const double *param, int nvec, int ifl, 
+                           double *photar, double *photer, const char* init) {
+stokes_grid su;
+batch_cell  *order;
+int         k, v, ie, err = 0;
+
+settings_read();
+if (stokes_setup(x, ear, ne, &su)) {
+  for (ie = 0; ie < nvec * ne; ie++) photar[ie] = 0.;
+  return 1;
+}
+// sort the vectors by the grid cell of the native tables, so that the 
+// vectors of one cell blend the same table memory one after another
+if ((order = (batch_cell *) malloc(nvec * sizeof(batch_cell))) != NULL) {
+  for (k = 0; k < nvec; k++) {
+    order[k].cell = su.tables != NULL ? tables_cell(su.tables, param + k * 8)
+                                      : 0;
+    order[k].index = k;
+  }
+  qsort(order, nvec, sizeof(batch_cell), batch_cell_compare);
+}
+#ifdef STOKESDISC_OFFLOAD
+if (!stokes_offload(x, ear, ne, &su, param, nvec, ifl, photar)) nvec = 0;
+#endif
+for (k = 0; k < nvec; k++) {
+  v = order != NULL ? order[k].index : k;
+  err |= stokes_evaluate(x, ear, ne, &su, param + v * 8, ifl, photar + v * ne,
+                         NULL);
+}
+free(order);
+return err;
+}
+
+// evaluates one parameter vector param[8] on ngrid energy grids 
+// ear[g][ne[g]+1] (e.g. the spectra of the time slices of an observation) 
+// into photar[g][ne[g]], the native tables are blended for the parameters 
+// once, for every grid they are only rebinned and the output is computed, 
+// returns 1 if any of the evaluations failed (its output is zero)
+int stokesnidisc_grids_ctx(stokes_context *x, int ngrid, 
+                           const double *const *ear, const int *ne, 
+                           const double *param, int ifl, 
+                           double *const *photar, const char* init) {
+stokes_grid su;
+int         g, ie, nemax = 0, err = 0;
+
+settings_read();
+// the work arrays for the largest grid are reserved at once
+for (g = 0; g < ngrid; g++) if (ne[g] > nemax) nemax = ne[g];
+workspace_reserve(&x->ws, nemax, 0);
+for (g = 0; g < ngrid; g++) {
+  if (stokes_setup(x, ear[g], ne[g], &su)) {
+    for (ie = 0; ie < ne[g]; ie++) photar[g][ie] = 0.;
+    err = 1;
+    continue;
+  }
+  err |= stokes_evaluate(x, ear[g], ne[g], &su, param, ifl, photar[g], NULL);
+}
+return err;
+}
+
+/*******************************************************************************
+* Evaluation server
+*
+* Compiled with -DSTOKESDISC_SERVER, the model becomes an evaluation server, 
+* a daemon that keeps the tables, the caches of the interpolated tables and 
+* the work arrays for all XSPEC processes of one computer, e.g.
+*   gcc -O2 -DSTOKESDISC_SERVER xsstokes_disc.c -I$HEADAS/include \
+*       -L$HEADAS/lib -lcfitsio -lm -lpthread -o stokes_server
+*   XSDIR=/path/to/xsstokes_disc-master ./stokes_server /tmp/stokesdisc.sock
+* It listens on the Unix socket given as the argument, serves every 
+* connection by a thread and evaluates the requests in a pool of contexts 
+* (SERVER_CONTEXTS by default, the optional second argument), a connection 
+* keeps using the same context while it is free, so the caches of the 
+* contexts are shared by all the processes. The settings of the server 
+* (XSDIR, STOKESDISC_...) are taken from its environment. The socket is 
+* created with the permissions 0600, so only the user running the server can
+* connect to it.
+*
+* After "xset STOKESDISC_SERVER /tmp/stokesdisc.sock" the entry points of the 
+* default context (stokesnidisc, stokesnidisc_batch, stokesnidisc_grids and 
+* stokesnidisc_deriv) send every call as one request over the socket (a batch
+* is one request) and the process neither loads the tables nor interpolates 
+* them. The output is that of the server's settings, par8 = -1 is resolved by
+* the calling process and inc_degrees is returned with the output. The 
+* batches larger than one request (SERVER_MAX doubles) are sent in parts. If 
+* the server cannot be reached (or the spectra have more than SERVER_MAX_NE 
+* bins), it is reported once and the model is evaluated in the process, a 
+* batch or the grids from the first part the server did not evaluate; such 
+* evaluations are counted by stats_server_local.
+*******************************************************************************/
+
+#define SERVER_MAGIC    0x53544b53      // "STKS"
+#define SERVER_EVAL     0               // stokesnidisc_batch_ctx()
+#define SERVER_DERIV    1               // stokesnidisc_deriv_ctx()
+#define SERVER_MAX      (1L << 26)      // maximum doubles of one request
+#define SERVER_MAX_NE   (1 << 22)       // maximum energy bins of one request
+#define SERVER_UNSET    -1              // no server is set
+#define SERVER_FAILED   -2              // not evaluated by the server set
+#define SERVER_CONTEXTS 4
+
+typedef struct {
+  int magic, kind, ne, nvec, ifl;
+} server_request;                       // followed by ear[ne+1], param[nvec][8]
+
+typedef struct {
+  int    status;
+  double inc_tot;
+} server_reply;                         // followed by photar[nvec][ne] and
+                                        // dphotar[3][ne] of SERVER_DERIV
+
+// sends n bytes to the socket, returns 1 on failure
+static int server_send(int fd, const void *buf, size_t n) {
+const char *b = (const char *) buf;
+ssize_t    k;
+
+while (n > 0) {
+  if ((k = send(fd, b, n, MSG_NOSIGNAL)) < 0 && errno == EINTR) continue;
+  if (k <= 0) return 1;
+  b += k;
+  n -= k;
+}
+return 0;
+}
+
+// receives n bytes from the socket, returns 1 on failure
+static int server_recv(int fd, void *buf, size_t n) {
+char    *b = (char *) buf;
+ssize_t k;
+
+while (n > 0) {
+  if ((k = recv(fd, b, n, 0)) < 0 && errno == EINTR) continue;
+  if (k <= 0) return 1;
+  b += k;
+  n -= k;
+}
+return 0;
+}
+
+// number of doubles of the request and of the reply, -1 if it is not valid
+// (the fields come from the socket, so they are checked before any 
+// arithmetic on them)
+static long server_size(const server_request *rq) {
+long n;
+
+if (rq->magic != SERVER_MAGIC || rq->ne < 1 || rq->ne > SERVER_MAX_NE || 
+    rq->nvec < 1 || rq->nvec > SERVER_MAX ||
+    (rq->kind != SERVER_EVAL && rq->kind != SERVER_DERIV) ||
+    (rq->kind == SERVER_DERIV && rq->nvec != 1))
+  return -1;
+n = (long) rq->nvec * (rq->ne + 8L) + rq->ne + 1L + 
+    (rq->kind == SERVER_DERIV ? 3L * rq->ne : 0L);
+return n > SERVER_MAX ? -1 : n;
+}
+
+// number of parameter vectors on ne energy bins of one request (at least 1)
+static int server_chunk(int ne) {
+long n = (SERVER_MAX - ne - 1L) / (ne + 8L);
+
+return n < 1 ? 1 : (int) n;
+}
+
+static char            pserver[128] = "STOKESDISC_SERVER";
+static char            server_path[PATH_LEN + 1] = "";
+static int             server_fd = -1, server_reported = 0;
+static pthread_mutex_t server_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// connects to the server of the socket path, returns the socket, -1 on failure
+static int server_connect(const char *path) {
+struct sockaddr_un addr;
+int                fd;
+
+if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return -1;
+memset(&addr, 0, sizeof(addr));
+addr.sun_family = AF_UNIX;
+strcpy(addr.sun_path, path);
+if (connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+  close(fd);
+  return -1;
+}
+return fd;
+}
+
+// evaluates nvec parameter vectors (one together with its derivatives if 
+// dphotar is not NULL) on the server set by STOKESDISC_SERVER, returns the 
+// status of the evaluation, SERVER_UNSET if no server is set or 
+// SERVER_FAILED if the server cannot be reached or the request is too large
+static int server_evaluate(const double *ear, int ne, const double *param, 
+                           int nvec, int ifl, double *photar, 
+                           double *dphotar) {
+static char    pinc_degrees[128] = "inc_degrees";
+server_request rq = {SERVER_MAGIC, dphotar != NULL ? SERVER_DERIV : SERVER_EVAL,
+                     ne, nvec, ifl};
+server_reply   rp;
+const char     *value;
+double         *par;
+char           path[PATH_LEN + 1], inc_degrees[32];
+int            k, attempt, status = SERVER_FAILED;
+
+// the setting is read for this call only, like the settings of the model
+pthread_mutex_lock(&xspec_lock);
+value = FGMSTR(pserver);
+snprintf(path, sizeof(path), "%s", value != NULL ? value : "");
+pthread_mutex_unlock(&xspec_lock);
+if (!path[0] || !strcmp(path, "off")) return SERVER_UNSET;
+if (server_size(&rq) < 0) {
+  pthread_mutex_lock(&server_lock);
+  if (!server_reported) {
+    stokes_write("stokes: the spectra are too large for the server of "
+                 "STOKESDISC_SERVER,", 5);
+    stokes_write("stokes: the model is evaluated in this process", 5);
+  }
+  server_reported = 1;
+  pthread_mutex_unlock(&server_lock);
+  return SERVER_FAILED;
+}
+if ((par = (double *) malloc(nvec * 8 * sizeof(double))) == NULL) 
+  return SERVER_FAILED;
+// the server does not know the data sets
+memcpy(par, param, nvec * 8 * sizeof(double));
+for (k = 0; k < nvec; k++) par[k * 8 + 7] = stokes_mode(param + k * 8, ifl);
+pthread_mutex_lock(&server_lock);
+if (strcmp(path, server_path)) {
+  if (server_fd >= 0) close(server_fd);
+  server_fd = -1;
+  server_reported = 0;
+  snprintf(server_path, sizeof(server_path), "%s", path);
+}
+// a connection broken since the last call is opened again once
+for (attempt = 0; attempt < 2 && status < 0; attempt++) {
+  if (server_fd < 0 && (server_fd = server_connect(path)) < 0) break;
+  if (server_send(server_fd, &rq, sizeof(rq)) || 
+      server_send(server_fd, ear, (ne + 1) * sizeof(double)) ||
+      server_send(server_fd, par, nvec * 8 * sizeof(double)) ||
+      server_recv(server_fd, &rp, sizeof(rp)) || 
+      server_recv(server_fd, photar, (long) nvec * ne * sizeof(double)) ||
+      (dphotar != NULL && 
+       server_recv(server_fd, dphotar, 3L * ne * sizeof(double)))) {
+    close(server_fd);
+    server_fd = -1;
+    continue;
+  }
+  status = rp.status;
+}
+if (status < 0 && !server_reported) {
+  stokes_write("stokes: the server of STOKESDISC_SERVER cannot be reached,", 5);
+  stokes_write("stokes: the model is evaluated in this process", 5);
+}
+server_reported = (status < 0);
+pthread_mutex_unlock(&server_lock);
+free(par);
+if (status >= 0) {
+  sprintf(inc_degrees, "%12.6f", rp.inc_tot);
+  pthread_mutex_lock(&xspec_lock);
+  FPMSTR(pinc_degrees, inc_degrees);
+  pthread_mutex_unlock(&xspec_lock);
+}
+return status;
+}
+
+#ifdef STOKESDISC_SERVER
+
+static struct {
+  stokes_context  **ctx;
+  int             *busy, n;
+  pthread_mutex_t lock;
+  pthread_cond_t  freed;
+} server_pool = {NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER, 
+                 PTHREAD_COND_INITIALIZER};
+
+// returns 1 if par8 of every parameter vector of the request is an output 
+// mode
+static int server_params_valid(const server_request *rq, const double *param) {
+int k;
+
+for (k = 0; k < rq->nvec; k++) 
+  if (!stokes_mode_valid(param[k * 8 + 7])) return 0;
+return 1;
+}
+
+// takes the context k of the pool if it is free, otherwise any free one, 
+// returns its index
+static int server_acquire(int k) {
+pthread_mutex_lock(&server_pool.lock);
+for (;;) {
+  if (k < 0 || k >= server_pool.n || server_pool.busy[k])
+    for (k = 0; k < server_pool.n && server_pool.busy[k]; k++);
+  if (k < server_pool.n) break;
+  pthread_cond_wait(&server_pool.freed, &server_pool.lock);
+}
+server_pool.busy[k] = 1;
+pthread_mutex_unlock(&server_pool.lock);
+return k;
+}
+
+static void server_release(int k) {
+pthread_mutex_lock(&server_pool.lock);
+server_pool.busy[k] = 0;
+pthread_cond_signal(&server_pool.freed);
+pthread_mutex_unlock(&server_pool.lock);
+}
+
+// serves the requests of one connection until it is closed or a request is 
+// not valid
+static void* server_connection(void *arg) {
+server_request rq;
+server_reply   rp;
+int            fd = (int) (intptr_t) arg, k = -1;
+long           n, size = 0, nin;
+double         *buf = NULL, *tmp, *photar;
+
+while (!server_recv(fd, &rq, sizeof(rq)) && (n = server_size(&rq)) > 0) {
+  if (n > size) {
+    if ((tmp = (double *) realloc(buf, n * sizeof(double))) == NULL) break;
+    buf = tmp;
+    size = n;
+  }
+  nin = rq.ne + 1 + rq.nvec * 8L;
+  if (server_recv(fd, buf, nin * sizeof(double)) || 
+      !server_params_valid(&rq, buf + rq.ne + 1)) 
+    break;
+  photar = buf + nin;
+  k = server_acquire(k);
+  if (rq.kind == SERVER_DERIV)
+    rp.status = stokesnidisc_deriv_ctx(server_pool.ctx[k], buf, rq.ne, 
+                                       buf + rq.ne + 1, rq.ifl, photar, 
+                                       photar + rq.ne, "");
+  else
+    rp.status = stokesnidisc_batch_ctx(server_pool.ctx[k], buf, rq.ne, 
+                                       buf + rq.ne + 1, rq.nvec, rq.ifl, 
+                                       photar, NULL, "");
+  rp.inc_tot = server_pool.ctx[k]->inc_tot;
+  server_release(k);
+  if (server_send(fd, &rp, sizeof(rp)) || 
+      server_send(fd, photar, (n - nin) * sizeof(double)))
+    break;
+}
+free(buf);
+close(fd);
+return NULL;
+}
+
+int main(int argc, char *argv[]) {
+struct sockaddr_un addr;
+struct stat        st;
+pthread_t          thread;
+mode_t             mask;
+int                fd, conn, k, status;
+
+if (argc < 2 || strlen(argv[1]) >= sizeof(addr.sun_path)) {
+  fprintf(stderr, "usage: %s socket [contexts]\n", argv[0]);
+  return 1;
+}
+server_pool.n = argc > 2 ? atoi(argv[2]) : SERVER_CONTEXTS;
+if (server_pool.n < 1) server_pool.n = 1;
+server_pool.ctx = (stokes_context **) calloc(server_pool.n, 
+                                             sizeof(stokes_context *));
+server_pool.busy = (int *) calloc(server_pool.n, sizeof(int));
+if (server_pool.ctx == NULL || server_pool.busy == NULL) {
+  fprintf(stderr, "stokes_server: not enough memory\n");
+  return 1;
+}
+for (k = 0; k < server_pool.n; k++) 
+  if ((server_pool.ctx[k] = stokesnidisc_context_new()) == NULL) {
+    fprintf(stderr, "stokes_server: not enough memory\n");
+    return 1;
+  }
+// a socket left by a previous server is replaced
+if (!lstat(argv[1], &st) && S_ISSOCK(st.st_mode)) unlink(argv[1]);
+memset(&addr, 0, sizeof(addr));
+addr.sun_family = AF_UNIX;
+strcpy(addr.sun_path, argv[1]);
+// the socket is bound with the permissions 0600 (not those of the umask), 
+// other local users cannot connect to it
+mask = umask(S_IRWXG | S_IRWXO | S_IXUSR);
+status = (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+         bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+umask(mask);
+if (status || listen(fd, 64)) {
+  fprintf(stderr, "stokes_server: cannot listen on %s: %s\n", argv[1], 
+          strerror(errno));
+  if (fd >= 0) close(fd);
+  if (!status) unlink(argv[1]);
+  return 1;
+}
+printf("stokes_server: listening on %s with %d contexts\n", argv[1], 
+       server_pool.n);
+fflush(stdout);
+for (;;) {
+  if ((conn = accept(fd, NULL, NULL)) < 0) {
+    if (errno == EINTR || errno == ECONNABORTED) continue;
+    fprintf(stderr, "stokes_server: %s\n", strerror(errno));
+    break;
+  }
+  if (pthread_create(&thread, NULL, server_connection, 
+                     (void *) (intptr_t) conn)) 
+    close(conn);
+  else 
+    pthread_detach(thread);
+}
+close(fd);
+unlink(argv[1]);
+return 1;
+}
+
+#endif
+
+// counts the n evaluations made in the process although a server is set 
+// (status SERVER_FAILED of server_evaluate()) and publishes the counters
+static void server_local(int status, long n) {
+if (status != SERVER_FAILED) return;
+context.stats.server_local += n;
+if (!context.stats.on) return;
+pthread_mutex_lock(&xspec_lock);
+stats_publish(&context.stats);
+pthread_mutex_unlock(&xspec_lock);
+}
+
+int stokesnidisc(const double *ear, int ne, const double *param, int ifl,
+            double *photar, double *photer, const char* init) {
+int status, err;
+
+if ((status = server_evaluate(ear, ne, param, 1, ifl, photar, NULL)) >= 0)
+  return status;
+err = stokesnidisc_ctx(&context, ear, ne, param, ifl, photar, photer, init);
+server_local(status, 1);
+return err;
+}
+
+// evaluates the model and its derivatives with respect to pol_deg, chi and 
+// pos_ang, dphotar[3][ne], in the default context
+int stokesnidisc_deriv(const double *ear, int ne, const double *param, int ifl,
+                       double *photar, double *dphotar, const char* init) {
+int status, err;
+
+if ((status = server_evaluate(ear, ne, param, 1, ifl, photar, dphotar)) >= 0)
+  return status;
+err = stokesnidisc_deriv_ctx(&context, ear, ne, param, ifl, photar, dphotar,
+                             init);
+server_local(status, 1);
+return err;
+}
+
+// evaluates nvec parameter vectors param[nvec][8] on the same energy grid ear,
+// the output of the vector k is stored in photar[k*ne...(k+1)*ne-1], 
+// returns 1 if any of the evaluations failed (its output is zero)
+int stokesnidisc_batch(const double *ear, int ne, const double *param, 
+                       int nvec, int ifl, double *photar, double *photer, 
+                       const char* init) {
+int status = SERVER_UNSET, chunk = server_chunk(ne), v, n, err = 0;
+
+// the batch is sent in parts of one request each, the vectors from the first
+// part the server did not evaluate are evaluated in the process
+for (v = 0; v < nvec; v += n) {
+  n = nvec - v < chunk ? nvec - v : chunk;
+  if ((status = server_evaluate(ear, ne, param + v * 8, n, ifl, 
+                                photar + (long) v * ne, NULL)) < 0) 
+    break;
+  err |= status;
+}
+if (v >= nvec) return err;
+err |= stokesnidisc_batch_ctx(&context, ear, ne, param + v * 8, nvec - v, ifl, 
+                              photar + (long) v * ne, photer, init);
+server_local(status, nvec - v);
+return err;
+}
+
+// evaluates one parameter vector on ngrid energy grids in the default context
+int stokesnidisc_grids(int ngrid, const double *const *ear, const int *ne, 
+                       const double *param, int ifl, double *const *photar, 
+                       const char* init) {
+int g, status = SERVER_UNSET, err = 0;
+
+// the grids from the first one the server did not evaluate are evaluated in
+// the process
+for (g = 0; g < ngrid; g++) {
+  if ((status = server_evaluate(ear[g], ne[g], param, 1, ifl, photar[g], 
+                                NULL)) < 0) 
+    break;
+  err |= status;
+}
+if (g >= ngrid) return err;
+err |= stokesnidisc_grids_ctx(&context, ngrid - g, ear + g, ne + g, param, ifl,
+                              photar + g, init);
+server_local(status, ngrid - g);
+return err;
+}
+
+/*******************************************************************************
+* XSPEC routines outside XSPEC
+*
+* Compiled with -DOUTSIDE_XSPEC (the benchmark below), -DSTOKESDISC_SERVER 
+* (the evaluation server above) or -DSTOKESDISC_LIBRARY (a standalone library
+* with the C interface of stokesnidisc(), stokesnidisc_batch(), 
+* stokesnidisc_grids(), stokesnidisc_deriv(), their context variants and the 
+* functions below, e.g. for the Python interface python/stokesdisc.py)
+*   gcc -O2 -fPIC -shared -DSTOKESDISC_LIBRARY xsstokes_disc.c \
+*       -I$HEADAS/include -L$HEADAS/lib -lcfitsio -lm -lpthread \
+*       -o libstokesdisc.so
+* the XSPEC routines are replaced by stubs. The xset settings are kept in a 
+* table set by stokesnidisc_xset() (and FPMSTR), the settings missing there 
+* are taken from the environment variables of the same names. The tables are 
+* interpolated by the native table engine (tabintxflt is not available, 
+* unless the benchmark is compiled with -DSTOKESDISC_TABINTXFLT and linked 
+* with the XSPEC libraries, see Section Accuracy suite) and par8 = -1 falls 
+* back to mode 0 as there are no data sets.
+*******************************************************************************/
+#if defined(OUTSIDE_XSPEC) || defined(STOKESDISC_LIBRARY) || \
+    defined(STOKESDISC_SERVER)
+
+#define XSET_MAX   64
+#define XSET_VALUE 256
+
+typedef struct {
+  char name[128];
+  char value[XSET_VALUE];
+} xset_entry;
+
+static xset_entry      xset_table[XSET_MAX];
+static int             xset_count = 0;
+static pthread_mutex_t xset_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// sets the xset value of the name, returns 1 if the name or the value are too
+// long or there are too many settings
+int stokesnidisc_xset(const char *name, const char *value) {
+int k, err = 0;
+
+if (strlen(name) >= sizeof(xset_table[0].name) || strlen(value) >= XSET_VALUE)
+  return 1;
+pthread_mutex_lock(&xset_lock);
+for (k = 0; k < xset_count && strcasecmp(xset_table[k].name, name); k++);
+if (k == xset_count && xset_count < XSET_MAX) 
+  strcpy(xset_table[xset_count++].name, name);
+if (k < xset_count) strcpy(xset_table[k].value, value);
+else err = 1;
+pthread_mutex_unlock(&xset_lock);
+return err;
+}
+
+// copies the xset value of the name ("" if it is not set) into value[size], 
+// returns 1 if it had to be cut
+int stokesnidisc_xget(const char *name, char *value, int size) {
+const char *env;
+int        k, len = -1;
+
+if (size < 1) return 1;
+pthread_mutex_lock(&xset_lock);
+for (k = 0; k < xset_count; k++) 
+  if (!strcasecmp(xset_table[k].name, name)) 
+    len = snprintf(value, size, "%s", xset_table[k].value);
+pthread_mutex_unlock(&xset_lock);
+if (len < 0) {
+  env = getenv(name);
+  len = snprintf(value, size, "%s", env != NULL ? env : "");
+}
+return len >= size;
+}
+
+int xs_write(char* wrtstr, int idest) {
+fprintf(stderr, "%s\n", wrtstr);
+return 0;
+}
+
+float DGFILT(int ifl, const char* key) {
+return -1.;
+}
+
+void FPMSTR(const char* value1, const char* value2) {
+stokesnidisc_xset(value1, value2);
+}
+
+char* FGMSTR(char* dname) {
+static _Thread_local char value[XSET_VALUE];
+
+stokesnidisc_xget(dname, value, XSET_VALUE);
+return value;
+}
+
+#if !defined(OUTSIDE_XSPEC) || !defined(STOKESDISC_TABINTXFLT)
+void tabintxflt(float* ear, int ne, float* param, const int npar, 
+                const char* filenm, const char **xfltname, 
+                const float *xfltvalue, const int nxflt,
+                const char* tabtyp, float* photar, float* photer) {
+static int reported = 0;
+int        ie;
+
+if (!reported) 
+  xs_write("stokes: tabintxflt is not available outside XSPEC", 5);
+reported = 1;
+for (ie = 0; ie < ne; ie++) photar[ie] = 0.;
+}
+#endif
+
+#endif
+
+/*******************************************************************************
+* Benchmark outside XSPEC
+*
+* Compiled with -DOUTSIDE_XSPEC the model is a standalone benchmark, e.g.
+*   gcc -O2 -DOUTSIDE_XSPEC xsstokes_disc.c -I$HEADAS/include -L$HEADAS/lib \
+*       -lcfitsio -lm -lpthread -o stokes_bench
+* The XSPEC routines are replaced by the stubs above, the xset settings (XSDIR,
+* STOKESDISC_...) are taken from the environment variables of the same names. 
+* The benchmark
+*   stokes_bench [ne_min [ne_max [seconds]]]
+* sweeps the number of energy bins from ne_min (default 100) to ne_max 
+* (default 100000) and the output modes 0-10 and for each of them reports 
+* the time per call and the number of calls per second for the evaluations
+* with new interpolation of the tables (cos_incl changes at every call) and 
+* cached ones (only pos_ang changes), each measured for the given number of 
+* seconds (default 0.2), together with the peak memory use of the process.
+* The input parameters of the benchmark are written into parameters.txt.
+*******************************************************************************/
+#ifdef OUTSIDE_XSPEC
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define NPARAM 8
+#define IFL    1
+#define NE_MIN 100
+#define NE_MAX 100000
+#define E_MIN  1.
+#define E_MAX  100.
+#define BENCH_TIME 0.2
+
+static double bench_clock(void) {
+struct timespec ts;
+
+clock_gettime(CLOCK_MONOTONIC, &ts);
+return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+// evaluates the model repeatedly for at least tmax seconds changing the 
+// parameter ipar at every call, returns the time per call in seconds
+static double bench_run(const double *ear, int ne, double *param, int ipar,
+                        double *photar, double tmax) {
+double t0, t, x0 = param[ipar];
+long   ncalls = 0;
+
+t0 = bench_clock();
+do {
+  param[ipar] = x0 + 1e-6 * (ncalls % 1000 + 1);
+  stokesnidisc(ear, ne, param, IFL, photar, NULL, "");
+  ncalls++;
+  t = bench_clock() - t0;
+} while (t < tmax);
+param[ipar] = x0;
+return t / ncalls;
+}
+
+/*******************************************************************************
+* Accuracy suite
+*
+* "stokes_bench accuracy [file]" evaluates all eleven modes for ACC_NSET 
+* parameter sets spanning the parameter ranges of lmodel-stokesdisc.dat (with
+* the table parameters in the outer loops, as by a fit) on ACC_NE energy bins
+* with each of the evaluation paths below in turn and reports the largest 
+* deviation of each path from the reference, together with its time per call
+* and its speedup over the reference path. The reference is the output of the
+* reference path (double precision interpolation of the tables read from the 
+* FITS files) stored in the file (stokes-accuracy.ref by default) by the first
+* run, later runs (e.g. of later versions of the model) are compared with the 
+* stored reference. The deviations of the polarisation angles (modes 6 and 7)
+* are in degrees, the other ones are relative to the reference value, but at 
+* least to ACC_FLOOR times the largest value of the spectrum.
+*
+* The reference itself is checked by the paths independent of the native 
+* engine or of the specialised output kernels: the kernel path computes the 
+* polarised output of all modes by the full kernel of the diagnostic output 
+* (written to /dev/null), and, if the benchmark is compiled with 
+* -DSTOKESDISC_TABINTXFLT and linked with the tabintxflt of XSPEC (e.g. with
+* -lXSFunctions -lXSUtil -lXS added to the libraries), the xspec path 
+* interpolates the tables by tabintxflt ("xset STOKESDISC_TABLES xspec"). The
+* threaded path is evaluated on ACC_NE_PAR bins instead (ACC_NE bins are not 
+* split over threads) and compared with the same path evaluated on one 
+* thread. The offload is also compared with the batches evaluated on the host
+* (the host path, "xset STOKESDISC_OFFLOAD off") for the parameter sets with 
+* chi = -90, 0 and 90 degrees, where the angle of the rotated Q and U lies on
+* the branch of atan2. Every path is evaluated in a process of its own, so 
+* that it loads the tables by its own settings (e.g. maps the preprocessed 
+* file) and starts with empty caches.
+*******************************************************************************/
+
+#define ACC_NE    100
+#define ACC_NE_PAR (4 * PAR_MIN_BINS) // the threaded path on its 4 threads
+#define ACC_NMODE 11
+#define ACC_NSET  1458
+#define ACC_FLOOR 1e-6
+#define ACC_FILE  "stokes-accuracy.ref"
+
+typedef struct {
+  const char *name;
+  const char *settings;      // xset settings of the path
+  int        batch;          // 1 - evaluated by stokesnidisc_batch
+  int        compare;        // ACC_REF, ACC_THREAD or ACC_HOST
+} acc_path;
+
+#define ACC_REF    0  // compared with the reference
+#define ACC_THREAD 1  // compared with one thread on ACC_NE_PAR bins
+#define ACC_HOST   2  // compared with the host evaluation of the same batches
+
+static const acc_path acc_paths[] = {
+  {"reference", "STOKESDISC_PRECISION=double STOKESDISC_STORAGE=full "
+                "STOKESDISC_BINARY=off STOKESDISC_THREADS=1 "
+                "STOKESDISC_OFFLOAD=off", 0, ACC_REF},
+  {"single",    "STOKESDISC_PRECISION=single STOKESDISC_STORAGE=full "
+                "STOKESDISC_BINARY=off STOKESDISC_THREADS=1 "
+                "STOKESDISC_OFFLOAD=off", 0, ACC_REF},
+  {"binary",    "STOKESDISC_PRECISION=single STOKESDISC_STORAGE=full "
+                "STOKESDISC_BINARY=auto STOKESDISC_THREADS=1 "
+                "STOKESDISC_OFFLOAD=off", 0, ACC_REF},
+  {"diff",      "STOKESDISC_PRECISION=single STOKESDISC_STORAGE=diff "
+                "STOKESDISC_BINARY=off STOKESDISC_THREADS=1 "
+                "STOKESDISC_OFFLOAD=off", 0, ACC_REF},
+  {"half",      "STOKESDISC_PRECISION=single STOKESDISC_STORAGE=half "
+                "STOKESDISC_BINARY=off STOKESDISC_THREADS=1 "
+                "STOKESDISC_OFFLOAD=off", 0, ACC_REF},
+  {"threads",   "STOKESDISC_PRECISION=single STOKESDISC_STORAGE=full "
+                "STOKESDISC_BINARY=off STOKESDISC_THREADS=4 "
+                "STOKESDISC_OFFLOAD=off", 0, ACC_THREAD},
+  {"batch",     "STOKESDISC_PRECISION=single STOKESDISC_STORAGE=full "
+                "STOKESDISC_BINARY=off STOKESDISC_THREADS=1 "
+                "STOKESDISC_OFFLOAD=off", 1, ACC_REF},
+  {"double",    "STOKESDISC_PRECISION=double STOKESDISC_STORAGE=full "
+                "STOKESDISC_BINARY=auto STOKESDISC_THREADS=1 "
+                "STOKESDISC_OFFLOAD=off", 1, ACC_REF},
+  {"kernel",    "STOKESDISC_PRECISION=double STOKESDISC_STORAGE=full "
+                "STOKESDISC_BINARY=off STOKESDISC_THREADS=1 "
+                "STOKESDISC_OFFLOAD=off STOKESDISC_DUMP=1", 0, ACC_REF},
+#ifdef STOKESDISC_TABINTXFLT
+  {"xspec",     "STOKESDISC_TABLES=xspec STOKESDISC_THREADS=1 "
+                "STOKESDISC_OFFLOAD=off", 0, ACC_REF},
+#endif
+#ifdef STOKESDISC_OFFLOAD
+  {"offload",   "STOKESDISC_PRECISION=single STOKESDISC_STORAGE=full "
+                "STOKESDISC_BINARY=off STOKESDISC_THREADS=1 "
+                "STOKESDISC_OFFLOAD=on", 1, ACC_REF},
+  {"host",      "STOKESDISC_PRECISION=single STOKESDISC_STORAGE=full "
+                "STOKESDISC_BINARY=off STOKESDISC_THREADS=1 "
+                "STOKESDISC_OFFLOAD=on", 1, ACC_HOST},
+#endif
+};
+
+// grid values of the parameters (zshift last)
+static const int    acc_nval[NPARAM - 1] = {3, 3, 3, 2, 3, 3, 3};
+static const double acc_val[NPARAM - 1][3] = {{0.2, 0.6, 1.0}, 
+  {1.2, 2.1, 3.0}, {0.025, 0.5, 0.975}, {0.1, 1.}, {-90., -30., 60.}, 
+  {-90., -20., 45.}, {-0.5, 0., 1.}};
+
+// the columns of the deviations of the modes
+static const int    acc_column[ACC_NMODE] = {6, 0, 1, 2, 6, 3, 4, 5, 6, 6, 6};
+
+// returns the parameters of the parameter set s (pos_ang changing fastest)
+static void acc_param(int s, int stokes, double *param) {
+static const int order[NPARAM - 1] = {5, 4, 3, 6, 2, 1, 0};
+int              k, p;
+
+for (k = 0; k < NPARAM - 1; k++) {
+  p = order[k];
+  param[p] = acc_val[p][s % acc_nval[p]];
+  s /= acc_nval[p];
+}
+param[7] = stokes;
+}
+
+// sets the xset settings "NAME=VALUE NAME=VALUE ..." of a path
+static void acc_settings(const char *settings) {
+char buf[512], *tok, *eq, *save;
+
+strcpy(buf, settings);
+for (tok = strtok_r(buf, " ", &save); tok != NULL; 
+     tok = strtok_r(NULL, " ", &save)) 
+  if ((eq = strchr(tok, '=')) != NULL) {
+    *eq = '\0';
+    stokesnidisc_xset(tok, eq + 1);
+  }
+}
+
+// evaluates all modes of all parameter sets by the path into 
+// out[set][mode][ACC_NE], returns the time per call in seconds or -1 if any 
+// of the evaluations failed
+static double acc_sweep(const acc_path *path, const double *ear, double *par,
+                        double *tmp, double *out) {
+double t0;
+int    s, stokes, ie, err = 0;
+
+acc_settings(path->settings);
+t0 = bench_clock();
+for (s = 0; s < ACC_NSET && !path->batch; s++) 
+  for (stokes = 0; stokes < ACC_NMODE; stokes++) {
+    acc_param(s, stokes, par);
+    err |= stokesnidisc(ear, ACC_NE, par, IFL, 
+                        out + (s * ACC_NMODE + stokes) * ACC_NE, NULL, "");
+  }
+for (stokes = 0; stokes < ACC_NMODE && path->batch; stokes++) {
+  for (s = 0; s < ACC_NSET; s++) acc_param(s, stokes, par + s * NPARAM);
+  err |= stokesnidisc_batch(ear, ACC_NE, par, ACC_NSET, IFL, tmp, NULL, "");
+  for (s = 0; s < ACC_NSET; s++) 
+    for (ie = 0; ie < ACC_NE; ie++) 
+      out[(s * ACC_NMODE + stokes) * ACC_NE + ie] = tmp[s * ACC_NE + ie];
+}
+return err ? -1. : (bench_clock() - t0) / (ACC_NSET * ACC_NMODE);
+}
+
+// returns the largest deviation of the output a[ne] from the reference r of 
+// the mode stokes
+static double acc_deviation(const double *ear, int ne, const double *a, 
+                            const double *r, int stokes) {
+double rmax = 0., den, dev = 0., d;
+int    ie;
+
+for (ie = 0; ie < ne; ie++) if (fabs(r[ie]) > rmax) rmax = fabs(r[ie]);
+for (ie = 0; ie < ne; ie++) {
+  d = fabs(a[ie] - r[ie]);
+  if (stokes == 6 || stokes == 7) d /= ear[ie + 1] - ear[ie];
+  else {
+    den = fabs(r[ie]) > ACC_FLOOR * rmax ? fabs(r[ie]) : ACC_FLOOR * rmax;
+    d = den > 0. ? d / den : (d > 0. ? 1. : 0.);
+  }
+  if (!(d <= dev)) dev = d;
+}
+return dev;
+}
+
+// evaluates all modes of all parameter sets by the path on ACC_NE_PAR bins 
+// and by the path on one thread in a context of its own, stores the largest 
+// deviations of the columns into dev[0...6] and the time per call on one 
+// thread into dev[7], returns the time per call of the path in seconds or -1
+// if any of the evaluations failed
+static double acc_sweep_parallel(const acc_path *path, double *par, 
+                                 double *dev) {
+stokes_context *x;
+double         ear[ACC_NE_PAR + 1], a[ACC_NE_PAR], r[ACC_NE_PAR], t0, t = 0.;
+double         t1 = 0., d;
+int            s, stokes, ie, err = 0;
+
+if ((x = stokesnidisc_context_new()) == NULL) return -1.;
+for (ie = 0; ie <= ACC_NE_PAR; ie++) 
+  ear[ie] = E_MIN * pow(E_MAX / E_MIN, ((double) ie) / ACC_NE_PAR);
+for (s = 0; s < 7; s++) dev[s] = 0.;
+for (s = 0; s < ACC_NSET; s++) 
+  for (stokes = 0; stokes < ACC_NMODE; stokes++) {
+    acc_param(s, stokes, par);
+    acc_settings(path->settings);
+    t0 = bench_clock();
+    err |= stokesnidisc(ear, ACC_NE_PAR, par, IFL, a, NULL, "");
+    t += bench_clock() - t0;
+    stokesnidisc_xset("STOKESDISC_THREADS", "1");
+    t0 = bench_clock();
+    err |= stokesnidisc_ctx(x, ear, ACC_NE_PAR, par, IFL, r, NULL, "");
+    t1 += bench_clock() - t0;
+    d = acc_deviation(ear, ACC_NE_PAR, a, r, stokes);
+    if (!(d <= dev[acc_column[stokes]])) dev[acc_column[stokes]] = d;
+  }
+stokesnidisc_context_free(x);
+dev[7] = t1 / (ACC_NSET * ACC_NMODE);
+return err ? -1. : t / (ACC_NSET * ACC_NMODE);
+}
+
+#ifdef STOKESDISC_OFFLOAD
+// evaluates all modes of all parameter sets with chi = -90, 0 and 90 by the 
+// batches of the path and by the same batches on the host in a context of 
+// its own, stores the largest deviations of the columns into dev[0...6] and 
+// the time per call on the host into dev[7], returns the time per call of the
+// path in seconds or -1 if any of the evaluations failed
+static double acc_sweep_host(const acc_path *path, const double *ear, 
+                             double *par, double *tmp, double *out, 
+                             double *dev) {
+static const double chi[3] = {-90., 0., 90.};
+stokes_context      *x;
+double              t0, t = 0., t1 = 0., d;
+int                 s, stokes, err = 0;
+
+if ((x = stokesnidisc_context_new()) == NULL) return -1.;
+for (s = 0; s < 7; s++) dev[s] = 0.;
+for (stokes = 0; stokes < ACC_NMODE; stokes++) {
+  // chi is the second fastest parameter of acc_param()
+  for (s = 0; s < ACC_NSET; s++) {
+    acc_param(s, stokes, par + s * NPARAM);
+    par[s * NPARAM + 4] = chi[s / acc_nval[5] % acc_nval[4]];
+  }
+  acc_settings(path->settings);
+  t0 = bench_clock();
+  err |= stokesnidisc_batch(ear, ACC_NE, par, ACC_NSET, IFL, tmp, NULL, "");
+  t += bench_clock() - t0;
+  stokesnidisc_xset("STOKESDISC_OFFLOAD", "off");
+  t0 = bench_clock();
+  err |= stokesnidisc_batch_ctx(x, ear, ACC_NE, par, ACC_NSET, IFL, out, 
+                                NULL, "");
+  t1 += bench_clock() - t0;
+  for (s = 0; s < ACC_NSET; s++) {
+    d = acc_deviation(ear, ACC_NE, tmp + s * ACC_NE, out + s * ACC_NE, 
+                      stokes);
+    if (!(d <= dev[acc_column[stokes]])) dev[acc_column[stokes]] = d;
+  }
+}
+stokesnidisc_context_free(x);
+dev[7] = t1 / (ACC_NSET * ACC_NMODE);
+return err ? -1. : t / (ACC_NSET * ACC_NMODE);
+}
+#endif
+
+// evaluates the path by acc_sweep() (acc_sweep_parallel() or acc_sweep_host()
+// into dev[0...7]) in
+// a child process into out and its time per call into *t (all shared with 
+// it), returns the time per call in seconds or -1 on failure
+static double acc_child(const acc_path *path, const double *ear, double *par,
+                        double *tmp, double *out, double *t, double *dev) {
+pid_t pid;
+int   status;
+
+*t = -1.;
+fflush(stdout);
+fflush(stderr);
+if ((pid = fork()) < 0) return -1.;
+if (pid == 0) {
+  stokesnidisc_context_dump(&context, "/dev/null");
+  if (path->compare == ACC_THREAD) *t = acc_sweep_parallel(path, par, dev);
+#ifdef STOKESDISC_OFFLOAD
+  else if (path->compare == ACC_HOST) 
+    *t = acc_sweep_host(path, ear, par, tmp, out, dev);
+#endif
+  else *t = acc_sweep(path, ear, par, tmp, out);
+  _exit(*t < 0.);
+}
+if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || 
+    WEXITSTATUS(status)) 
+  return -1.;
+return *t;
+}
+
+// runs the accuracy suite with the reference stored in the file, returns 1 
+// on failure
+static int bench_accuracy(const char *file) {
+static const char *header = "xsstokes_disc accuracy reference v1 %d %d %d\n";
+const int         npath = sizeof(acc_paths) / sizeof(acc_paths[0]);
+const size_t      nout = (size_t) ACC_NSET * ACC_NMODE * ACC_NE;
+double            ear[ACC_NE + 1], *par, *tmp, *ref, *out, *shared, t;
+double            tref = 0.;
+double            *dev, d;
+char              line[128], expect[128];
+FILE              *f;
+int               ie, k, s, stokes, stored = 0;
+
+par = (double *) malloc(ACC_NSET * NPARAM * sizeof(double));
+tmp = (double *) malloc(ACC_NSET * ACC_NE * sizeof(double));
+ref = (double *) malloc(nout * sizeof(double));
+// the time per call, the deviations and the time on one thread of the 
+// threaded path and the output of the path come from its process
+shared = (double *) mmap(NULL, (nout + 9) * sizeof(double), 
+                         PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                         -1, 0);
+dev = shared != MAP_FAILED ? shared + 1 : NULL;
+out = shared != MAP_FAILED ? shared + 9 : NULL;
+if (par == NULL || tmp == NULL || ref == NULL || out == NULL) {
+  fprintf(stderr, "not enough memory for the accuracy suite\n");
+  return 1;
+}
+for (ie = 0; ie <= ACC_NE; ie++) 
+  ear[ie] = E_MIN * pow(E_MAX / E_MIN, ((double) ie) / ACC_NE);
+// the stored reference
+sprintf(expect, header, ACC_NSET, ACC_NMODE, ACC_NE);
+if ((f = fopen(file, "rb")) != NULL) {
+  if (fgets(line, sizeof(line), f) == NULL || strcmp(line, expect) || 
+      fread(ref, sizeof(double), nout, f) != nout) {
+    fprintf(stderr, "%s is not a reference of this accuracy suite\n", file);
+    fclose(f);
+    return 1;
+  }
+  fclose(f);
+  stored = 1;
+}
+printf("# %d parameter sets x %d modes on %d energy bins, reference %s%s\n",
+       ACC_NSET, ACC_NMODE, ACC_NE, file, stored ? "" : " (new)");
+printf("# path           I        Q        U       PD  PA[deg] PA2[deg]"
+       "    other  [us]/call  speedup\n");
+for (k = 0; k < npath; k++) {
+  if ((t = acc_child(&acc_paths[k], ear, par, tmp, out, shared, dev)) < 0.) {
+    fprintf(stderr, "the evaluation of the path %s failed\n", 
+            acc_paths[k].name);
+    return 1;
+  }
+  if (k == 0) tref = t;
+  // the first run stores the output of the reference path
+  if (k == 0 && !stored) {
+    memcpy(ref, out, nout * sizeof(double));
+    if ((f = fopen(file, "wb")) == NULL || fputs(expect, f) == EOF || 
+        fwrite(ref, sizeof(double), nout, f) != nout) 
+      fprintf(stderr, "the reference cannot be written into %s\n", file);
+    if (f != NULL) fclose(f);
+  }
+  for (s = 0; s < 7 && acc_paths[k].compare == ACC_REF; s++) dev[s] = 0.;
+  for (s = 0; s < ACC_NSET && acc_paths[k].compare == ACC_REF; s++) 
+    for (stokes = 0; stokes < ACC_NMODE; stokes++) {
+      ie = (s * ACC_NMODE + stokes) * ACC_NE;
+      d = acc_deviation(ear, ACC_NE, out + ie, ref + ie, stokes);
+      if (!(d <= dev[acc_column[stokes]])) dev[acc_column[stokes]] = d;
+    }
+  printf("%-11s", acc_paths[k].name);
+  for (s = 0; s < 7; s++) printf(" %8.1e", dev[s]);
+  // the speedup of the threaded path is over one thread, of the host path 
+  // over the host
+  printf(" %10.2f %8.2f\n", 1e6 * t, 
+         (acc_paths[k].compare != ACC_REF ? dev[7] : tref) / t);
+  fflush(stdout);
+}
+free(par);
+free(tmp);
+free(ref);
+munmap(shared, (nout + 9) * sizeof(double));
+return 0;
+}
+
+int main(int argc, char *argv[]) {
+
+double *ear, *photar, param[NPARAM], tmax, tnew, tcached;
+struct rusage usage;
+FILE   *fw;
+int    ne, ne_min, ne_max, ie, stokes;
+
+param[ 0] = 0.3;        // Size
+param[ 1] = 2.0;        // PhoIndex
+param[ 2] = 0.775;      // cos_incl
+param[ 3] = 0.;         // poldeg
+param[ 4] = 0.;         // chi
+param[ 5] = 0.;         // pos_ang
+param[ 6] = 0.;         // zshift
+param[ 7] = 1.;         // Stokes
+
+if (argc > 1 && !strcmp(argv[1], "accuracy")) 
+  return bench_accuracy(argc > 2 ? argv[2] : ACC_FILE);
+ne_min = argc > 1 ? atoi(argv[1]) : NE_MIN;
+ne_max = argc > 2 ? atoi(argv[2]) : NE_MAX;
+tmax = argc > 3 ? atof(argv[3]) : BENCH_TIME;
+if (ne_min < 1 || ne_max < ne_min) {
+  fprintf(stderr, "usage: %s [ne_min [ne_max [seconds]]]\n"
+                  "       %s accuracy [reference file]\n", argv[0], argv[0]);
+  return 1;
+}
+// let's write the input parameters to a file
+if ((fw = fopen("parameters.txt", "w")) != NULL) {
+  fprintf(fw, "Size        %12.6f\n", param[0]);
+  fprintf(fw, "PhoIndex        %12.6f\n", param[1]);
+  fprintf(fw, "cos_incl     %12.6f\n", param[2]);
+  fprintf(fw, "poldeg        %12.6f\n", param[3]);
+  fprintf(fw, "chi         %12.6f\n", param[4]);
+  fprintf(fw, "pos_ang        %12.6f\n", param[5]);
+  fprintf(fw, "zshift      %12.6f\n", param[6]);
+  fprintf(fw, "Stokes      %12d\n", (int) param[7]);
+  fprintf(fw, "inc_degrees      %12.6f\n", acos(param[2]) / PI * 180.);
+  fclose(fw);
+}
+
+printf("#     ne mode    new [us]    calls/s  cached [us]    calls/s "
+       "maxrss [MB]\n");
+for (ne = ne_min; ne <= ne_max; ne *= 10) {
+  ear = (double *) malloc((ne + 1) * sizeof(double));
+  photar = (double *) malloc(ne * sizeof(double));
+  if (ear == NULL || photar == NULL) {
+    fprintf(stderr, "not enough memory for %d energy bins\n", ne);
+    return 1;
+  }
+  for(ie = 0; ie <= ne; ie++) {
+    ear[ie] = E_MIN * pow(E_MAX / E_MIN, ((double) ie) / ne);
+  }
+  for (stokes = 0; stokes <= 10; stokes++) {
+    param[7] = stokes;
+    if (stokesnidisc(ear, ne, param, IFL, photar, NULL, "")) return 1;
+    tnew = bench_run(ear, ne, param, 2, photar, tmax);
+    tcached = bench_run(ear, ne, param, 5, photar, tmax);
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%8d %4d %11.2f %10.1f %11.2f %10.1f %11.1f\n", ne, stokes, 
+           1e6 * tnew, 1. / tnew, 1e6 * tcached, 1. / tcached, 
+           usage.ru_maxrss / 1024.);
+    fflush(stdout);
+  }
+  free(ear);
+  free(photar);
+  if (ne > ne_max / 10) break;
+}
+return(0);
+}
+
+#endif